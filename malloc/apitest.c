@@ -0,0 +1,314 @@
+/*
+ * apitest.c - call each entry point of mm.c that mdriver does not, and
+ * check what comes back.
+ *
+ *     usage: apitest
+ *
+ * Covers mm_memalign and mm_aligned_alloc(and that the alignment survives
+ * an in place realloc), mm_calloc(on memory that was dirtied and freed
+ * first), mm_malloc_batch and mm_free_batch, regions and pools. Built with
+ * -DMM_THREADS("make apitest-mt"), it also runs threads that free the
+ * blocks and put back the pool objects of each other. Each failed check
+ * prints its line and exits with 1; "make test" runs both builds.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
+
+#include "memlib.h"
+#include "mm.h"
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "apitest.c:%d: %s failed\n", __LINE__, #cond); \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#define HUGE_SIZE (2 << 20) /* past MM_MMAP_THRESHOLD of mm.c */
+
+/* sizes that reach slabs, fast bins, size classes, the tree and mmap */
+static const size_t sizes[] = {1, 8, 24, 100, 500, 3000, 20000, HUGE_SIZE};
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+/* fill - write the pattern of seed over n bytes at p. */
+static void fill(void *p, size_t n, unsigned seed)
+{
+    unsigned char *c = p;
+    for (size_t i = 0; i < n; i++)
+        c[i] = (unsigned char)(seed + i * 7);
+}
+
+/* holds - whether the n bytes at p still hold the pattern of seed. */
+static int holds(const void *p, size_t n, unsigned seed)
+{
+    const unsigned char *c = p;
+    for (size_t i = 0; i < n; i++)
+        if (c[i] != (unsigned char)(seed + i * 7))
+            return 0;
+    return 1;
+}
+
+/* aligned - whether p is a multiple of align. */
+static int aligned(const void *p, size_t align)
+{
+    return ((uintptr_t)p & (align - 1)) == 0;
+}
+
+static void test_memalign(void)
+{
+    CHECK(mm_memalign(0, 16) == NULL);
+    CHECK(mm_memalign(24, 16) == NULL);
+    CHECK(mm_aligned_alloc(3, 16) == NULL);
+    CHECK(mm_memalign(64, 0) == NULL);
+    for (size_t align = 8; align <= 8192; align <<= 1) {
+        for (size_t i = 0; i < NSIZES; i++) {
+            size_t size = sizes[i];
+            void *p = (align & 1024) ? mm_aligned_alloc(align, size)
+                                     : mm_memalign(align, size);
+            CHECK(p != NULL && aligned(p, align));
+            fill(p, size, (unsigned)align);
+            /* shrinking stays in place, so the alignment holds */
+            if (size > 1) {
+                void *q = mm_realloc(p, size / 2);
+                CHECK(q == p && holds(q, size / 2, (unsigned)align));
+            }
+            /* growing may move, but keeps the bytes */
+            void *r = mm_realloc(p, size + 1000);
+            CHECK(r != NULL && aligned(r, 8));
+            CHECK(holds(r, size / 2 ? size / 2 : 1, (unsigned)align));
+            mm_free(r);
+        }
+    }
+}
+
+static void test_calloc(void)
+{
+    CHECK(mm_calloc(SIZE_MAX / 2, 4) == NULL);
+    for (size_t i = 0; i < NSIZES; i++) {
+        size_t size = sizes[i];
+        /* dirty the blocks calloc is most likely to get back */
+        void *p[4];
+        for (int k = 0; k < 4; k++) {
+            p[k] = mm_malloc(size);
+            CHECK(p[k] != NULL);
+            memset(p[k], 0xa5, size);
+        }
+        for (int k = 0; k < 4; k++)
+            mm_free(p[k]);
+        for (int k = 0; k < 4; k++) {
+            size_t n = size >= 4 ? size / 4 : 1;
+            size_t each = size >= 4 ? 4 : size;
+            unsigned char *c = mm_calloc(n, each);
+            CHECK(c != NULL && aligned(c, 8));
+            for (size_t j = 0; j < n * each; j++)
+                CHECK(c[j] == 0);
+            p[k] = c;
+        }
+        for (int k = 0; k < 4; k++)
+            mm_free(p[k]);
+    }
+}
+
+static void test_batch(void)
+{
+    static const size_t counts[] = {1, 7, 64, 300};
+    void *out[300];
+    CHECK(mm_malloc_batch(16, 0, out) == 0);
+    CHECK(mm_malloc_batch(0, 4, out) == -1);
+    for (size_t i = 0; i < NSIZES; i++) {
+        size_t size = sizes[i];
+        for (size_t j = 0; j < sizeof(counts) / sizeof(counts[0]); j++) {
+            size_t n = size == HUGE_SIZE ? counts[j] % 8 : counts[j];
+            CHECK(mm_malloc_batch(size, n, out) == 0);
+            /* blocks that overlap would spoil the pattern of another */
+            for (size_t k = 0; k < n; k++) {
+                CHECK(out[k] != NULL && aligned(out[k], 8));
+                fill(out[k], size, (unsigned)k);
+            }
+            for (size_t k = 0; k < n; k++)
+                CHECK(holds(out[k], size, (unsigned)k));
+            /* out of address order, with holes */
+            for (size_t k = 0; k + 1 < n; k += 2) {
+                void *t = out[k];
+                out[k] = out[k + 1];
+                out[k + 1] = t;
+            }
+            if (n > 3) {
+                mm_free(out[3]);
+                out[3] = NULL;
+            }
+            mm_free_batch(out, n);
+        }
+    }
+}
+
+static void test_region(void)
+{
+    struct mm_region *region = mm_region_create(0);
+    CHECK(region != NULL);
+    CHECK(mm_region_alloc(region, 0) == NULL);
+    for (int round = 0; round < 3; round++) {
+        void *first = NULL;
+        void *p[2000];
+        for (int i = 0; i < 2000; i++) {
+            /* some are too large for a chunk and get their own */
+            size_t size = i % 100 == 99 ? 10000 : 1 + i % 60;
+            p[i] = mm_region_alloc(region, size);
+            CHECK(p[i] != NULL && aligned(p[i], 8));
+            fill(p[i], size, (unsigned)i);
+            if (i == 0)
+                first = p[0];
+        }
+        for (int i = 0; i < 2000; i++)
+            CHECK(holds(p[i], i % 100 == 99 ? 10000 : 1 + i % 60,
+                        (unsigned)i));
+        mm_region_reset(region);
+        /* the first chunk is kept and bumped from its start again */
+        CHECK(mm_region_alloc(region, 1) == first);
+        mm_region_reset(region);
+    }
+    mm_region_destroy(region);
+    mm_region_destroy(NULL);
+
+    region = mm_region_create(100);
+    CHECK(region != NULL);
+    for (int i = 0; i < 100; i++)
+        CHECK(mm_region_alloc(region, 40) != NULL);
+    mm_region_destroy(region);
+}
+
+static void test_pool(void)
+{
+    CHECK(mm_pool_create(0, 8) == NULL);
+    CHECK(mm_pool_create(32, 24) == NULL);
+    struct mm_pool *pool = mm_pool_create(48, 64);
+    CHECK(pool != NULL);
+    void *p[500];
+    for (int i = 0; i < 500; i++) {
+        p[i] = mm_pool_get(pool);
+        CHECK(p[i] != NULL && aligned(p[i], 64));
+        fill(p[i], 48, (unsigned)i);
+    }
+    for (int i = 0; i < 500; i++)
+        CHECK(holds(p[i], 48, (unsigned)i));
+    /* an object put back is the next one handed out */
+    for (int i = 0; i < 500; i++) {
+        mm_pool_put(pool, p[i]);
+        CHECK(mm_pool_get(pool) == p[i]);
+    }
+    for (int i = 0; i < 500; i++)
+        mm_pool_put(pool, p[i]);
+    mm_pool_put(pool, NULL);
+    mm_pool_destroy(pool);
+    mm_pool_destroy(NULL);
+
+    /* objects too large for one per line */
+    pool = mm_pool_create(5000, 0);
+    CHECK(pool != NULL);
+    for (int i = 0; i < 20; i++) {
+        p[i] = mm_pool_get(pool);
+        CHECK(p[i] != NULL && aligned(p[i], 8));
+        fill(p[i], 5000, (unsigned)i);
+    }
+    for (int i = 0; i < 20; i++)
+        CHECK(holds(p[i], 5000, (unsigned)i));
+    mm_pool_destroy(pool);
+}
+
+#ifdef MM_THREADS
+#define NTHREADS 4
+#define NBLOCKS 2000
+#define NROUNDS 20
+
+/* what each thread made in a round, for the next thread to free */
+static void *blocks[NTHREADS][NBLOCKS];
+static size_t lens[NTHREADS][NBLOCKS];
+static void *objs[NTHREADS][NBLOCKS];
+static struct mm_pool *shared;
+static pthread_barrier_t barrier;
+
+/* worker - make blocks and objects, then free those of the next thread. */
+static void *worker(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    unsigned seed = (unsigned)id * 7919 + 1;
+    for (int round = 0; round < NROUNDS; round++) {
+        for (int i = 0; i < NBLOCKS; i++) {
+            size_t size = 1 + rand_r(&seed) % (i % 16 == 0 ? 4000 : 200);
+            void *p;
+            switch (i % 4) {
+            case 0:
+                p = mm_malloc(size);
+                break;
+            case 1:
+                p = mm_calloc(1, size);
+                break;
+            case 2:
+                p = mm_memalign(64, size);
+                break;
+            default:
+                p = mm_realloc(mm_malloc(size / 2 + 1), size);
+                break;
+            }
+            CHECK(p != NULL);
+            fill(p, size, (unsigned)(id + i));
+            blocks[id][i] = p;
+            lens[id][i] = size;
+            objs[id][i] = mm_pool_get(shared);
+            CHECK(objs[id][i] != NULL && aligned(objs[id][i], 32));
+            fill(objs[id][i], 40, (unsigned)(id + i));
+        }
+        pthread_barrier_wait(&barrier);
+        int from = (id + 1) % NTHREADS;
+        for (int i = 0; i < NBLOCKS; i++) {
+            CHECK(holds(blocks[from][i], lens[from][i],
+                        (unsigned)(from + i)));
+            CHECK(holds(objs[from][i], 40, (unsigned)(from + i)));
+            mm_pool_put(shared, objs[from][i]);
+        }
+        /* half one by one, half in a batch */
+        for (int i = 0; i < NBLOCKS / 2; i++)
+            mm_free(blocks[from][i]);
+        mm_free_batch(&blocks[from][NBLOCKS / 2], NBLOCKS - NBLOCKS / 2);
+        pthread_barrier_wait(&barrier);
+    }
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    pthread_t tids[NTHREADS];
+    shared = mm_pool_create(40, 32);
+    CHECK(shared != NULL);
+    pthread_barrier_init(&barrier, NULL, NTHREADS);
+    for (int i = 0; i < NTHREADS; i++)
+        CHECK(pthread_create(&tids[i], NULL, worker, (void *)(intptr_t)i)
+              == 0);
+    for (int i = 0; i < NTHREADS; i++)
+        pthread_join(tids[i], NULL);
+    pthread_barrier_destroy(&barrier);
+    mm_pool_destroy(shared);
+}
+#endif
+
+int main(void)
+{
+    mem_init();
+    CHECK(mm_init() == 0);
+    test_memalign();
+    test_calloc();
+    test_batch();
+    test_region();
+    test_pool();
+#ifdef MM_THREADS
+    test_threads();
+#endif
+    printf("apitest: all checks passed\n");
+    return 0;
+}
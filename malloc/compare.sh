@@ -0,0 +1,44 @@
+#!/bin/sh
+# usage: compare.sh <variant>...
+# Runs ./mdriver-<variant> for each variant over traces/ and prints the
+# util and throughput(Kops) of every trace side by side.
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+for v in "$@"; do
+    # keep the per trace lines and the total of "mdriver -v". Columns are
+    # fixed width, and Kops may run into secs.
+    ./mdriver-$v -v -t traces/ | awk '
+        function trim(s) { gsub(/ /, "", s); return s }
+        /^Results for mm malloc/ { on = 1; next }
+        on && /^( *[0-9]+ |Total)/ {
+            print $1, trim(substr($0, 13, 6)), trim(substr($0, 37, 6))
+        }
+    ' > "$tmp/$v" || exit 1
+done
+
+printf "%-6s" trace
+for v in "$@"; do
+    printf " %16s" "$v"
+done
+printf "\n%-6s" ""
+for v in "$@"; do
+    printf " %6s %9s" util Kops
+done
+printf "\n"
+
+awk '
+    FNR == 1 { nfile++ }
+    {
+        if (nfile == 1) order[++nrow] = $1
+        cell[$1, nfile] = sprintf(" %6s %9s", $2, $3)
+    }
+    END {
+        for (i = 1; i <= nrow; i++) {
+            row = sprintf("%-6s", order[i])
+            for (f = 1; f <= nfile; f++) row = row cell[order[i], f]
+            print row
+        }
+    }
+' $(for v in "$@"; do echo "$tmp/$v"; done)
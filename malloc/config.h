@@ -62,6 +62,19 @@
  */
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
 
+/*
+ * Built with -DMEM_MMAP, memlib reserves MEM_RESERVE bytes of address
+ * space instead, and commits them as the heap grows. HEAP_LIMIT is the
+ * most the heap can grow to either way.
+ */
+#define MEM_RESERVE (1U<<30)   /* 1 GB */
+
+#ifdef MEM_MMAP
+#define HEAP_LIMIT MEM_RESERVE
+#else
+#define HEAP_LIMIT MAX_HEAP
+#endif
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
@@ -0,0 +1,28 @@
+/*
+ * heapmap.h - layout of the heap maps written by mm_dump_heap.
+ *
+ * A map is a struct heap_hdr followed by one struct heap_rec per block of
+ * the heap in address order, up to the end of the file.
+ */
+#include <stdint.h>
+
+#define HEAP_MAGIC 0x50484d4dU /* "MMHP" */
+
+/* states of a block */
+#define HEAP_FREE 0 /* free */
+#define HEAP_USED 1 /* allocated(or cached by the allocator) */
+#define HEAP_SLAB 2 /* a slab of small payloads */
+
+struct heap_hdr {
+    uint32_t magic; /* HEAP_MAGIC */
+    uint32_t rate;  /* one in rate allocations has its site recorded */
+    uint64_t base;  /* address of the first byte of the heap */
+};
+
+struct heap_rec {
+    uint32_t offset;  /* from the first byte of the heap */
+    uint32_t size;    /* of the whole block */
+    uint32_t state;   /* HEAP_FREE, HEAP_USED or HEAP_SLAB */
+    uint32_t request; /* size asked for, if the site is known */
+    uint64_t site;    /* return address of the allocating call, or 0 */
+};
@@ -0,0 +1,166 @@
+/*
+ * heapprof.c - summarize a heap map written by mm_dump_heap.
+ *
+ *     usage: heapprof <map>
+ *
+ * Prints, for each allocation site seen in the map, the blocks it still
+ * holds, the bytes they take against the bytes asked for(the difference
+ * is internal fragmentation), and the free bytes they pin: each free
+ * block is charged half to the block on either side of it, since it can
+ * not merge with anything until they are freed. Only one in rate
+ * allocations has its site recorded, so the counts of a site are samples;
+ * blocks without a site are summed up in one row.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heapmap.h"
+
+/* what one site holds */
+struct site {
+    uint64_t site;       /* return address, 0 for unknown */
+    unsigned long count; /* blocks */
+    uint64_t bytes;      /* size of the blocks */
+    uint64_t request;    /* bytes asked for, if known */
+    uint64_t pinned;     /* free bytes next to the blocks */
+};
+
+static struct site *sites;
+static size_t nsites, cap;
+
+/* find_site - the row of site, added if missing. */
+static struct site *find_site(uint64_t site)
+{
+    for (size_t i = 0; i < nsites; i++)
+        if (sites[i].site == site)
+            return &sites[i];
+    if (nsites == cap) {
+        cap = cap ? 2 * cap : 64;
+        if ((sites = realloc(sites, cap * sizeof(*sites))) == NULL) {
+            perror("heapprof: realloc");
+            exit(1);
+        }
+    }
+    memset(&sites[nsites], 0, sizeof(*sites));
+    sites[nsites].site = site;
+    return &sites[nsites++];
+}
+
+/* site_of - the row a block counts toward, NULL for free blocks and slabs. */
+static struct site *site_of(const struct heap_rec *rec)
+{
+    return rec->state == HEAP_USED ? find_site(rec->site) : NULL;
+}
+
+/* by_bytes - order rows by the bytes they take, largest first. */
+static int by_bytes(const void *a, const void *b)
+{
+    uint64_t x = ((const struct site *)a)->bytes;
+    uint64_t y = ((const struct site *)b)->bytes;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <map>\n", argv[0]);
+        return 1;
+    }
+    FILE *fp = fopen(argv[1], "rb");
+    if (fp == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    struct heap_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != HEAP_MAGIC) {
+        fprintf(stderr, "%s: not a heap map\n", argv[1]);
+        return 1;
+    }
+
+    /* read the blocks, they are in address order */
+    struct heap_rec *recs = NULL;
+    size_t nrecs = 0, rcap = 0;
+    for (;;) {
+        if (nrecs == rcap) {
+            rcap = rcap ? 2 * rcap : 1024;
+            if ((recs = realloc(recs, rcap * sizeof(*recs))) == NULL) {
+                perror("heapprof: realloc");
+                return 1;
+            }
+        }
+        if (fread(&recs[nrecs], sizeof(*recs), 1, fp) != 1)
+            break;
+        nrecs++;
+    }
+    fclose(fp);
+
+    uint64_t heap = 0, used = 0, free_bytes = 0, largest = 0, slabs = 0;
+    unsigned long nfree = 0;
+    for (size_t i = 0; i < nrecs; i++) {
+        struct heap_rec *rec = &recs[i];
+        heap += rec->size;
+        if (rec->state == HEAP_FREE) {
+            free_bytes += rec->size;
+            largest = rec->size > largest ? rec->size : largest;
+            nfree++;
+            /* blocks are adjacent only if nothing lies between them */
+            if (i > 0 && recs[i - 1].offset + recs[i - 1].size ==
+                rec->offset) {
+                struct site *s = site_of(&recs[i - 1]);
+                if (s != NULL)
+                    s->pinned += rec->size / 2;
+            }
+            if (i + 1 < nrecs && rec->offset + rec->size ==
+                recs[i + 1].offset) {
+                struct site *s = site_of(&recs[i + 1]);
+                if (s != NULL)
+                    s->pinned += rec->size - rec->size / 2;
+            }
+            continue;
+        }
+        used += rec->size;
+        if (rec->state == HEAP_SLAB) {
+            slabs += rec->size;
+            continue;
+        }
+        struct site *s = site_of(rec);
+        s->count++;
+        s->bytes += rec->size;
+        s->request += rec->request;
+    }
+
+    printf("heap at 0x%llx: %lu blocks, %llu bytes\n",
+           (unsigned long long)hdr.base, (unsigned long)nrecs,
+           (unsigned long long)heap);
+    printf("used %llu bytes(%llu in slabs), free %llu bytes in %lu blocks\n",
+           (unsigned long long)used, (unsigned long long)slabs,
+           (unsigned long long)free_bytes, nfree);
+    if (free_bytes != 0)
+        printf("fragmentation index %.3f(1 - largest free / free)\n",
+               1.0 - (double)largest / free_bytes);
+    printf("one in %u allocations sampled\n\n", hdr.rate);
+
+    qsort(sites, nsites, sizeof(*sites), by_bytes);
+    printf("%-18s %8s %12s %12s %10s %12s\n", "site", "blocks", "bytes",
+           "requested", "internal", "pinned free");
+    for (size_t i = 0; i < nsites; i++) {
+        struct site *s = &sites[i];
+        if (s->site == 0) {
+            /* the request size is only recorded with the site */
+            printf("%-18s %8lu %12llu %12s %10s %12llu\n", "(unsampled)",
+                   s->count, (unsigned long long)s->bytes, "-", "-",
+                   (unsigned long long)s->pinned);
+            continue;
+        }
+        printf("0x%-16llx %8lu %12llu %12llu %9.1f%% %12llu\n",
+               (unsigned long long)s->site, s->count,
+               (unsigned long long)s->bytes,
+               (unsigned long long)s->request,
+               100.0 * (s->bytes - s->request) / s->bytes,
+               (unsigned long long)s->pinned);
+    }
+    free(recs);
+    free(sites);
+    return 0;
+}
@@ -81,6 +81,7 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double max_op;   /* secs taken by the slowest request (0 for libc) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -124,6 +125,7 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static double eval_mm_latency(trace_t *trace);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -303,6 +305,7 @@ int main(int argc, char **argv)
 	    if (verbose > 1)
 		printf("and performance.\n");
 	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    mm_stats[i].max_op = eval_mm_latency(trace);
 	}
 	free_trace(trace);
     }
@@ -689,10 +692,9 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   largest size of the heap in bytes while running the student's
+ *   malloc package on the trace. mem_sbrk() can decrement the brk
+ *   pointer, so the heap size is sampled after every request.
  *   
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
@@ -702,6 +704,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
+    size_t heap_size = 0;
     char *p;
     char *newp, *oldp;
 
@@ -709,6 +712,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     mem_reset_brk();
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
+    heap_size = mem_heapsize();
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
@@ -772,9 +776,19 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+
+	/* Keep track of the largest heap */
+	heap_size = (mem_heapsize() > heap_size) ? mem_heapsize() : heap_size;
+    }
+
+#ifdef MM_STATS
+    if (verbose > 1) {
+	printf("\n");
+	mm_stats();
     }
+#endif
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)heap_size);
 }
 
 
@@ -825,6 +839,67 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * eval_mm_latency - Time each request of the trace on its own, and
+ *     return the secs taken by the slowest one. The trace is run
+ *     LATENCY_RUNS times and each request keeps its fastest time, so that
+ *     a request is only slow if it is slow every time (and not because of
+ *     an interrupt).
+ */
+#define LATENCY_RUNS 3
+static double eval_mm_latency(trace_t *trace)
+{
+    int i, run, index;
+    char *p;
+    struct timespec start, end;
+    double secs, max = 0;
+    double *best = malloc(trace->num_ops * sizeof(double));
+
+    if (best == NULL)
+	unix_error("malloc failed in eval_mm_latency");
+    for (i = 0; i < trace->num_ops; i++)
+	best[i] = DBL_MAX;
+
+    for (run = 0; run < LATENCY_RUNS; run++) {
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_mm_latency");
+	for (i = 0; i < trace->num_ops; i++) {
+	    index = trace->ops[i].index;
+	    clock_gettime(CLOCK_MONOTONIC, &start);
+	    switch (trace->ops[i].type) {
+	    case ALLOC: /* mm_malloc */
+		if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+		    app_error("mm_malloc error in eval_mm_latency");
+		trace->blocks[index] = p;
+		break;
+	    case REALLOC: /* mm_realloc */
+		p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+		if (p == NULL)
+		    app_error("mm_realloc error in eval_mm_latency");
+		trace->blocks[index] = p;
+		break;
+	    case FREE: /* mm_free */
+		mm_free(trace->blocks[index]);
+		break;
+	    default:
+		app_error("Nonexistent request type in eval_mm_latency");
+	    }
+	    clock_gettime(CLOCK_MONOTONIC, &end);
+	    secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	    if (secs < best[i])
+		best[i] = secs;
+	}
+    }
+
+    for (i = 0; i < trace->num_ops; i++)
+	if (best[i] > max)
+	    max = best[i];
+    free(best);
+    return max;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -924,48 +999,70 @@ static void printresults(int n, stats_t *stats)
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double max_op = 0;
+    char max_ns[16];
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%8s%10s%6s%8s%8s\n", 
+	   "trace", " valid", "util", "ops", "secs", "Kops", "avg ns",
+	   "max ns");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    /* the slowest request is only timed for the student malloc */
+	    if (stats[i].max_op > 0)
+		sprintf(max_ns, "%.0f", stats[i].max_op*1e9);
+	    else
+		strcpy(max_ns, "-");
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f%8.0f%8s\n", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
-		   (stats[i].ops/1e3)/stats[i].secs);
+		   (stats[i].ops/1e3)/stats[i].secs,
+		   stats[i].secs/stats[i].ops*1e9,
+		   max_ns);
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
+	    if (stats[i].max_op > max_op)
+		max_op = stats[i].max_op;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%6s\n", 
+	    printf("%2d%10s%6s%8s%10s%6s%8s%8s\n", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
+		   "-",
+		   "-",
 		   "-");
 	}
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	if (max_op > 0)
+	    sprintf(max_ns, "%.0f", max_op*1e9);
+	else
+	    strcpy(max_ns, "-");
+	printf("%12s%5.0f%%%8.0f%10.6f%6.0f%8.0f%8s\n", 
 	       "Total       ",
 	       (util/n)*100.0,
 	       ops, 
 	       secs,
-	       (ops/1e3)/secs);
+	       (ops/1e3)/secs,
+	       secs/ops*1e9,
+	       max_ns);
     }
     else {
-	printf("%12s%6s%8s%10s%6s\n", 
+	printf("%12s%6s%8s%10s%6s%8s%8s\n", 
 	       "Total       ",
 	       "-", 
 	       "-", 
+	       "-",
+	       "-",
 	       "-", 
 	       "-");
     }
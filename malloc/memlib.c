@@ -2,6 +2,11 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            Built with -DMEM_MMAP, the heap lives in a range of address
+ *            space reserved with mmap(PROT_NONE), and pages are committed
+ *            with mprotect only as mem_sbrk reaches them. The heap can then
+ *            grow up to MEM_RESERVE bytes, and only costs what it uses.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,6 +15,9 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
 
 #include "memlib.h"
 #include "config.h"
@@ -18,20 +26,41 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_zero_brk;   /* no byte from here on has been written */
+#ifdef MEM_MMAP
+static char *mem_commit_brk; /* end of the committed pages */
+#endif
+#ifdef MM_THREADS
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER; /* guards mem_brk */
+#endif
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
+#ifdef MEM_MMAP
+    /* reserve the address space only; nothing is committed yet */
+    mem_start_brk = (char *)mmap(NULL, HEAP_LIMIT, PROT_NONE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				 -1, 0);
+    if (mem_start_brk == (char *)MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
+	exit(1);
+    }
+    mem_commit_brk = mem_start_brk;
+#else
     /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+    /* zeroed, like the pages a real sbrk hands out */
+    if ((mem_start_brk = (char *)calloc(1, MAX_HEAP)) == NULL) {
 	fprintf(stderr, "mem_init_vm: malloc error\n");
 	exit(1);
     }
+#endif
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_max_addr = mem_start_brk + HEAP_LIMIT; /* max legal heap address */
+    mem_brk = mem_start_brk;                   /* heap is empty initially */
+    mem_zero_brk = mem_start_brk;
 }
 
 /* 
@@ -39,7 +68,11 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
+#ifdef MEM_MMAP
+    munmap(mem_start_brk, HEAP_LIMIT);
+#else
     free(mem_start_brk);
+#endif
 }
 
 /*
@@ -47,27 +80,81 @@ void mem_deinit(void)
  */
 void mem_reset_brk()
 {
+    /* with MEM_MMAP, pages committed so far stay committed for reuse */
     mem_brk = mem_start_brk;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap, but never below its start; with
+ *    MEM_MMAP the whole pages above the new brk are decommitted. Built
+ *    with -DMM_THREADS, it may be called from several threads at once.
  */
 void *mem_sbrk(int incr) 
 {
-    char *old_brk = mem_brk;
+    char *old_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+#ifdef MM_THREADS
+    pthread_mutex_lock(&mem_lock);
+#endif
+    old_brk = mem_brk;
+    if ( (mem_brk + incr < mem_start_brk) || ((mem_brk + incr) > mem_max_addr)) {
+#ifdef MM_THREADS
+	pthread_mutex_unlock(&mem_lock);
+#endif
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
+#ifdef MEM_MMAP
+    if (mem_brk + incr > mem_commit_brk) {
+	/* commit the pages up to the new brk */
+	size_t pagesize = mem_pagesize();
+	char *commit = mem_start_brk + (((mem_brk + incr - mem_start_brk) +
+					 pagesize - 1) & ~(pagesize - 1));
+	if (mprotect(mem_commit_brk, commit - mem_commit_brk,
+		     PROT_READ | PROT_WRITE) != 0) {
+#ifdef MM_THREADS
+	    pthread_mutex_unlock(&mem_lock);
+#endif
+	    errno = ENOMEM;
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Can't commit pages...\n");
+	    return (void *)-1;
+	}
+	mem_commit_brk = commit;
+    } else if (incr < 0) {
+	/* give back the pages above the new brk */
+	size_t pagesize = mem_pagesize();
+	char *commit = mem_start_brk + (((mem_brk + incr - mem_start_brk) +
+					 pagesize - 1) & ~(pagesize - 1));
+	if (commit < mem_commit_brk) {
+	    madvise(commit, mem_commit_brk - commit, MADV_DONTNEED);
+	    mprotect(commit, mem_commit_brk - commit, PROT_NONE);
+	    mem_commit_brk = commit;
+	    if (commit < mem_zero_brk)
+		mem_zero_brk = commit;
+	}
+    }
+#endif
     mem_brk += incr;
+    if (mem_brk > mem_zero_brk)
+	mem_zero_brk = mem_brk;
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&mem_lock);
+#endif
     return (void *)old_brk;
 }
 
+/*
+ * mem_zero_lo - return the address from which on every byte of the
+ *    heap(and of what mem_sbrk may add to it) is still zero
+ */
+void *mem_zero_lo()
+{
+    return (void *)mem_zero_brk;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
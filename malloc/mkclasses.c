@@ -0,0 +1,385 @@
+/*
+ * mkclasses.c - pick the size classes of mm.c from a set of traces.
+ *
+ *     usage: mkclasses [-o header] <trace>...
+ *
+ * Replays each trace(in the .rep format of mdriver) without allocating,
+ * and reports the distribution of request sizes, the lifetime of blocks
+ * in operations(from the malloc or realloc that made them to the free or
+ * realloc that ended them), and the peak live bytes of each size. From
+ * those it picks the thresholds of mm.c and writes them, with the table
+ * of size classes they imply, to a header(mm_classes.h by default) that
+ * mm.c includes. "make classes" runs it on traces/.
+ *
+ * Sizes are block sizes as mm.c sees them(see blk_need): the request plus
+ * a header word, rounded up to ALIGNMENT, and at least MIN_BLOCK bytes.
+ * The choices are:
+ *   MM_SLAB_MAX     requests below it are carved from slabs. A slot saves
+ *                   the header and padding of a block, but each class in
+ *                   use costs a slab that may stay mostly empty, and slabs
+ *                   cut the heap into pieces that do not merge. So it is
+ *                   just above the largest slot size whose peak live
+ *                   count saves at least a slab(SLAB_SIZE bytes), and
+ *                   that saves at least 1/SLAB_GAIN of each slot.
+ *   MM_TREE_SHIFT   blocks of 2^MM_TREE_SHIFT bytes and up go to the
+ *                   splay tree, which fits them best. Lists only pay off
+ *                   for sizes that come back, so it is the first power of
+ *                   two(from 2^TREE_LO) past which the requests of each
+ *                   block size are fewer than REPEAT on average.
+ *   MM_CLASS_SHIFT  each power of two below the tree is split into
+ *                   2^MM_CLASS_SHIFT classes. It is the smallest split
+ *                   that keeps the hot sizes(at least HOT_SHARE of the
+ *                   requests) in classes of their own, so find_fit does
+ *                   not probe past blocks of another hot size.
+ *   MM_FAST_MAX     blocks up to this size are cached in fast bins, which
+ *                   only pays off for blocks freed soon after they are
+ *                   made. It covers the largest power of two below the
+ *                   tree where at least FAST_SHARE of the frees come
+ *                   within SHORT_LIFE operations of the malloc.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the block layout of mm.c, which is built with the same CFLAGS */
+#define ALIGNMENT 8
+#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(size_t)(ALIGNMENT - 1))
+/* used_meta_sz() in mm.c: the size word */
+#define HDR_SIZE ALIGN(sizeof(size_t))
+/* free_meta_sz() in mm.c: the size word and two list links, then a footer */
+#define MIN_BLOCK ALIGN(sizeof(size_t) + 2 * sizeof(unsigned) + sizeof(size_t))
+#define SLAB_SIZE 1024 /* MM_SLAB_SIZE in mm.c */
+
+#define NBUCKETS 32 /* power of two buckets of sizes and of lifetimes */
+
+#define SLAB_MIN 16 /* bounds for MM_SLAB_MAX */
+#define SLAB_LIMIT 128
+#define SLAB_GAIN 4
+#define TREE_LO 8 /* bounds for MM_TREE_SHIFT */
+#define TREE_HI 16
+#define REPEAT 4
+#define CLASS_LO 1 /* bounds for MM_CLASS_SHIFT */
+#define CLASS_HI 5
+#define HOT_SHARE 0.01
+#define FAST_LO 64 /* lower bound for MM_FAST_MAX */
+#define FAST_SHARE 0.25
+#define SHORT_LIFE 64
+
+/* the block sizes below this are counted one by one */
+#define MAX_EXACT (1 << TREE_HI)
+
+/* what is known about the blocks of one trace, or of all of them */
+struct prof {
+    unsigned long reqs[MAX_EXACT / ALIGNMENT]; /* requests by block size */
+    unsigned long big;                         /* requests past MAX_EXACT */
+    unsigned long size_hist[NBUCKETS];         /* requests by log2(size) */
+    unsigned long life_hist[NBUCKETS];         /* frees by log2(lifetime) */
+    unsigned long never;                       /* blocks never freed */
+    /* frees of blocks of log2 size b, and those within SHORT_LIFE ops */
+    unsigned long frees[NBUCKETS], short_frees[NBUCKETS];
+    unsigned long live[NBUCKETS]; /* live bytes by log2(size) */
+    unsigned long peak[NBUCKETS]; /* the most of them at once */
+    /* live requests by slot size / ALIGNMENT, and the most at once */
+    unsigned long slots[SLAB_LIMIT / ALIGNMENT + 1];
+    unsigned long slot_peak[SLAB_LIMIT / ALIGNMENT + 1];
+};
+
+static struct prof all, cur;
+
+/* a block of a trace */
+struct block {
+    size_t size; /* of the request, 0 if not live */
+    long born;   /* index of the op that made it */
+};
+
+/* log2_of - index of the most significant set bit of x > 0 */
+static int log2_of(unsigned long x)
+{
+    int b = 0;
+    while (x >>= 1)
+        b++;
+    return b;
+}
+
+/* blk_size - the block mm.c carves for a request of size bytes */
+static size_t blk_size(size_t size)
+{
+    size_t blk = ALIGN(size + HDR_SIZE);
+    return blk < MIN_BLOCK ? MIN_BLOCK : blk;
+}
+
+/* slot_of - the slab class of a request of size bytes, if it is small */
+static size_t slot_of(size_t size)
+{
+    return (size + ALIGNMENT - 1) / ALIGNMENT;
+}
+
+static void born(struct block *b, size_t size, long op)
+{
+    size_t blk = blk_size(size);
+    int bucket = log2_of(blk);
+    b->size = size ? size : 1;
+    b->born = op;
+    if (blk < MAX_EXACT)
+        cur.reqs[blk / ALIGNMENT]++;
+    else
+        cur.big++;
+    cur.size_hist[log2_of(b->size)]++;
+    cur.live[bucket] += blk;
+    if (cur.live[bucket] > cur.peak[bucket])
+        cur.peak[bucket] = cur.live[bucket];
+    if (size <= SLAB_LIMIT) {
+        size_t slot = slot_of(size);
+        if (++cur.slots[slot] > cur.slot_peak[slot])
+            cur.slot_peak[slot] = cur.slots[slot];
+    }
+}
+
+static void died(struct block *b, long op)
+{
+    size_t blk = blk_size(b->size);
+    int bucket = log2_of(blk);
+    long life = op - b->born;
+    cur.life_hist[log2_of(life)]++;
+    cur.frees[bucket]++;
+    if (life <= SHORT_LIFE)
+        cur.short_frees[bucket]++;
+    cur.live[bucket] -= blk;
+    if (b->size <= SLAB_LIMIT)
+        cur.slots[slot_of(b->size)]--;
+    b->size = 0;
+}
+
+/* replay - add the trace in file path to all */
+static void replay(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    unsigned long heap, nids, nops, weight;
+    if (fscanf(fp, "%lu %lu %lu %lu", &heap, &nids, &nops, &weight) != 4) {
+        fprintf(stderr, "%s: bad header\n", path);
+        exit(1);
+    }
+    struct block *blocks = calloc(nids, sizeof(*blocks));
+    if (blocks == NULL) {
+        perror("mkclasses: calloc");
+        exit(1);
+    }
+    memset(&cur, 0, sizeof(cur));
+    char type[2];
+    unsigned long id, size;
+    for (long op = 1; fscanf(fp, "%1s %lu", type, &id) == 2; op++) {
+        if (id >= nids) {
+            fprintf(stderr, "%s: id %lu out of range\n", path, id);
+            exit(1);
+        }
+        struct block *b = &blocks[id];
+        switch (type[0]) {
+        case 'a':
+        case 'r':
+            if (fscanf(fp, "%lu", &size) != 1) {
+                fprintf(stderr, "%s: no size in op %ld\n", path, op);
+                exit(1);
+            }
+            if (b->size != 0)
+                died(b, op);
+            born(b, size, op);
+            break;
+        case 'f':
+            if (b->size != 0)
+                died(b, op);
+            break;
+        default:
+            fprintf(stderr, "%s: bad op '%s'\n", path, type);
+            exit(1);
+        }
+    }
+    for (unsigned long i = 0; i < nids; i++)
+        cur.never += blocks[i].size != 0;
+    free(blocks);
+    fclose(fp);
+
+    /* traces run on a fresh heap each, so peaks do not add up */
+    for (size_t i = 0; i < MAX_EXACT / ALIGNMENT; i++)
+        all.reqs[i] += cur.reqs[i];
+    all.big += cur.big;
+    all.never += cur.never;
+    for (int b = 0; b < NBUCKETS; b++) {
+        all.size_hist[b] += cur.size_hist[b];
+        all.life_hist[b] += cur.life_hist[b];
+        all.frees[b] += cur.frees[b];
+        all.short_frees[b] += cur.short_frees[b];
+        if (cur.peak[b] > all.peak[b])
+            all.peak[b] = cur.peak[b];
+    }
+    for (size_t i = 0; i <= SLAB_LIMIT / ALIGNMENT; i++)
+        if (cur.slot_peak[i] > all.slot_peak[i])
+            all.slot_peak[i] = cur.slot_peak[i];
+}
+
+/* below - requests of blocks smaller than size */
+static unsigned long below(size_t size)
+{
+    unsigned long n = 0;
+    for (size_t i = 0; i < size / ALIGNMENT && i < MAX_EXACT / ALIGNMENT; i++)
+        n += all.reqs[i];
+    return n;
+}
+
+/*
+ * class_of - the free list of a block of size bytes, for classes of
+ *     2^shift per power of two(see size_class in mm.c).
+ */
+static size_t class_of(size_t size, int shift)
+{
+    size_t linear = (size_t)ALIGNMENT << shift;
+    if (size < linear)
+        return size / ALIGNMENT;
+    int fl = log2_of(size);
+    return ((size_t)(fl - log2_of(linear) + 1) << shift) +
+           ((size >> (fl - shift)) & ((1U << shift) - 1));
+}
+
+static int pick_slab_max(void)
+{
+    int max = SLAB_MIN;
+    for (size_t slot = 1; slot * ALIGNMENT < SLAB_LIMIT; slot++) {
+        size_t size = slot * ALIGNMENT;
+        unsigned long saved = all.slot_peak[slot] * (blk_size(size) - size);
+        if (saved >= SLAB_SIZE && blk_size(size) - size >= size / SLAB_GAIN &&
+            (int)size + ALIGNMENT > max)
+            max = size + ALIGNMENT;
+    }
+    return max;
+}
+
+static int pick_tree_shift(void)
+{
+    for (int shift = TREE_LO; shift < TREE_HI; shift++) {
+        unsigned long n = 0, sizes = 0;
+        size_t lo = (size_t)1 << shift;
+        for (size_t size = lo; size < 2 * lo; size += ALIGNMENT) {
+            n += all.reqs[size / ALIGNMENT];
+            sizes += all.reqs[size / ALIGNMENT] != 0;
+        }
+        if (n < REPEAT * sizes)
+            return shift;
+    }
+    return TREE_HI;
+}
+
+static int pick_class_shift(int tree_shift)
+{
+    size_t tree_min = (size_t)1 << tree_shift;
+    unsigned long total = below(tree_min);
+    for (int shift = CLASS_LO; shift < CLASS_HI; shift++) {
+        int clash = 0;
+        size_t last = (size_t)-1;
+        for (size_t size = 0; size < tree_min && !clash; size += ALIGNMENT) {
+            if (all.reqs[size / ALIGNMENT] < HOT_SHARE * total)
+                continue;
+            size_t idx = class_of(size, shift);
+            clash = idx == last;
+            last = idx;
+        }
+        if (!clash)
+            return shift;
+    }
+    return CLASS_HI;
+}
+
+static size_t pick_fast_max(int tree_shift)
+{
+    size_t max = FAST_LO;
+    /* fast bins only hold blocks below the tree */
+    for (int b = log2_of(FAST_LO); b + 1 < tree_shift; b++)
+        if (all.frees[b] != 0 &&
+            all.short_frees[b] >= FAST_SHARE * all.frees[b])
+            max = (size_t)2 << b;
+    return max;
+}
+
+static void print_hist(const char *what, const unsigned long *hist,
+                       const char *unit)
+{
+    printf("%s:\n", what);
+    for (int b = 0; b < NBUCKETS; b++)
+        if (hist[b] != 0)
+            printf("  [%lu, %lu) %s\t%lu\n", 1UL << b, 2UL << b, unit,
+                   hist[b]);
+}
+
+/* write_header - write the choices and their classes to path */
+static void write_header(const char *path, int ntraces, int slab_max,
+                         int tree_shift, int class_shift, size_t fast_max)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    fprintf(fp, "/*\n"
+                " * %s - size classes of mm.c, picked by mkclasses from %d\n"
+                " * traces. Do not edit, run \"make classes\" instead.\n"
+                " */\n",
+            name, ntraces);
+    fprintf(fp, "#define MM_SLAB_MAX %d\n", slab_max);
+    fprintf(fp, "#define MM_FAST_MAX %zu\n", fast_max);
+    fprintf(fp, "#define MM_CLASS_SHIFT %d\n", class_shift);
+    fprintf(fp, "#define MM_TREE_SHIFT %d\n\n", tree_shift);
+    fprintf(fp, "/** smallest block size of each class of bins_ */\n");
+    fprintf(fp, "static const unsigned int mm_class_min[] = {");
+    size_t tree_min = (size_t)1 << tree_shift;
+    int n = 0;
+    for (size_t size = 0; size < tree_min; size += ALIGNMENT) {
+        if (size != 0 && class_of(size, class_shift) ==
+                             class_of(size - ALIGNMENT, class_shift))
+            continue;
+        fprintf(fp, n % 8 == 0 ? "\n    %zu," : " %zu,", size);
+        n++;
+    }
+    fprintf(fp, "\n};\n");
+    if (fclose(fp) != 0) {
+        perror(path);
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *out = "mm_classes.h";
+    int i = 1;
+    if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+        out = argv[2];
+        i = 3;
+    }
+    if (i == argc) {
+        fprintf(stderr, "usage: %s [-o header] <trace>...\n", argv[0]);
+        return 1;
+    }
+    for (int j = i; j < argc; j++)
+        replay(argv[j]);
+    if (below(MAX_EXACT) + all.big == 0) {
+        fprintf(stderr, "mkclasses: no requests\n");
+        return 1;
+    }
+
+    print_hist("request sizes", all.size_hist, "bytes");
+    print_hist("lifetimes", all.life_hist, "ops");
+    printf("  never freed\t%lu\n", all.never);
+    print_hist("peak live bytes by block size", all.peak, "bytes");
+
+    int slab_max = pick_slab_max();
+    int tree_shift = pick_tree_shift();
+    int class_shift = pick_class_shift(tree_shift);
+    size_t fast_max = pick_fast_max(tree_shift);
+    printf("MM_SLAB_MAX %d, MM_FAST_MAX %zu, MM_CLASS_SHIFT %d, "
+           "MM_TREE_SHIFT %d\n",
+           slab_max, fast_max, class_shift, tree_shift);
+    write_header(out, argc - i, slab_max, tree_shift, class_shift, fast_max);
+    return 0;
+}
@@ -0,0 +1,504 @@
+/*
+ * mm-buddy.c - a binary buddy allocator.
+ *
+ * Every block is 2^k bytes(k is its order), and starts at an offset from
+ * mem_heap_lo() that is a multiple of its size. So the buddy of a block,
+ * the other half of the block it was split from, is at its offset XOR
+ * 2^k: a free block finds its buddy without reading any header. Bit i of
+ * the bitmap of order k is set iff the block of order k at offset i * 2^k
+ * is free, so merging a freed block with its buddy, then with the buddy
+ * of the result and so on, is a bit test per order. There is one doubly
+ * linked free list per order, and a bitmap of the non-empty ones.
+ *
+ * A request takes the block of the smallest order that holds it and a
+ * header word, so up to half of a block may be wasted; in exchange, free
+ * blocks never need to be searched or split by size, and no block has a
+ * footer. On the traces it is faster than mm.c, but it keeps only about
+ * 30-50% of the heap in use on those that ask for sizes just above a power
+ * of two(binary*, realloc*), and random-bal does not fit in MAX_HEAP at
+ * all, which is why the Makefile builds it with -DMEM_MMAP.
+ *
+ * Block layout:
+ *   used block: [order | payload ... ]
+ *   free block: [order | BUDDY_FREE | next | prev | ... ]
+ * next and prev are indexes of blocks of BUDDY_MIN_ORDER, plus one(0 for
+ * none).
+ *
+ * Build it with "make mdriver-buddy".
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "memlib.h"
+#include "mm.h"
+
+team_t team = {
+    /* Team name */
+    "fdyrd",
+    /* First member's full name */
+    "Rundong Yang",
+    /* First member's email address */
+    "yangrundong7@gmail.com",
+    /* Second member's full name (leave blank if none) */
+    "",
+    /* Second member's email address (leave blank if none) */
+    ""};
+
+/* single word (4) or double word (8) alignment */
+#define ALIGNMENT 8
+
+/* rounds up to the nearest multiple of ALIGNMENT */
+#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~0x7)
+
+/**
+ * Orders. The smallest block holds a free block's meta; the largest is
+ * bounded by how far the heap may grow.
+ */
+#define BUDDY_MIN_ORDER 4
+#define BUDDY_MAX_ORDER 30
+#define BUDDY_ORDERS (BUDDY_MAX_ORDER + 1)
+
+/** tag in the header of a free block */
+#define BUDDY_FREE 0x100
+
+/** words of the bitmap of order k */
+#define BUDDY_MAP_WORDS(k) ((HEAP_LIMIT >> (k)) / 32 + 1)
+
+/**
+ * With DEBUG, every MM_CHECK_PERIOD operations the whole heap is checked.
+ */
+#ifndef MM_CHECK_PERIOD
+#define MM_CHECK_PERIOD 256
+#endif
+
+/** Layout of free block: [order | next | prev | ... ] */
+struct free_meta {
+  size_t order_;      // order, and BUDDY_FREE
+  unsigned int next_; // successor in the free list
+  unsigned int prev_; // predecessor in the free list
+};
+
+/** Everything that tracks the free blocks. */
+struct control {
+  /** bit k is set iff lists_[k] is non-empty */
+  unsigned long orders_;
+  /** heads of the free lists, one per order */
+  void *lists_[BUDDY_ORDERS];
+  /** first word of the bitmap of each order in buddy_map */
+  size_t map_at_[BUDDY_ORDERS];
+  /** bytes of the heap; every block lies below it */
+  size_t end_;
+  /** the most the heap has had since the bitmaps were clear */
+  size_t high_;
+#ifdef DEBUG
+  /** operations since the last full check */
+  unsigned int checks_;
+#endif
+};
+
+static struct control buddy;
+
+/** the bitmaps of free blocks, of all orders one after another */
+static unsigned int buddy_map[2 * BUDDY_MAP_WORDS(BUDDY_MIN_ORDER) +
+                              BUDDY_ORDERS];
+
+/** Utility macros */
+#define static_cast(a, Tp) ((Tp)(a))
+
+/** end of list */
+#define MMEOL ((void *)0)
+
+/**
+ * @return size of the header of a block.
+ */
+static inline size_t hdr_sz(void) { return ALIGN(sizeof(size_t)); }
+
+/************************************************
+ * Helper Functions Prototypes
+ ************************************************/
+
+/**
+ * @return the order of the smallest block that holds size bytes.
+ */
+static inline size_t order_of(size_t size);
+
+/**
+ * @return non zero if the block of order k at offset off is free.
+ */
+static inline int is_free(size_t off, size_t k);
+
+/**
+ * @brief set or clear the bit of the block of order k at offset off.
+ */
+static inline void mark(size_t off, size_t k, int free);
+
+/**
+ * @brief put the block of order k at offset off on the free lists, after
+ * merging it with its free buddies.
+ */
+static void free_blk(size_t off, size_t k);
+
+/**
+ * @brief take the free block of order k at offset off off its list.
+ */
+static void remove_blk(size_t off, size_t k);
+
+/**
+ * @brief find a free block of order k, splitting a larger one if needed,
+ * and take it off the lists.
+ * @return its offset, or (size_t)-1 if there is none.
+ */
+static size_t find_blk(size_t k);
+
+/**
+ * @brief grow the heap by a block of order k.
+ * @return its offset, or (size_t)-1 if the heap can not grow.
+ */
+static size_t grow_heap(size_t k);
+
+/**
+ * @brief with DEBUG, check the whole heap once every MM_CHECK_PERIOD calls.
+ */
+static void check(void);
+
+/**
+ * @return the block at offset off.
+ */
+static inline void *blk_at(size_t off) { return mem_heap_lo() + off; }
+
+/**
+ * @return offset of the block blk.
+ */
+static inline size_t blk_off(void *blk) {
+  return static_cast(blk - mem_heap_lo(), size_t);
+}
+
+/**
+ * @return order of the block blk.
+ */
+static inline size_t blk_order(void *blk) {
+  return static_cast(blk, size_t *)[0] & ~static_cast(BUDDY_FREE, size_t);
+}
+
+/*
+ * mm_init - initialize the malloc package.
+ */
+int mm_init(void) {
+  // only the part of the bitmaps the last heap reached can be dirty.
+  for (size_t k = BUDDY_MIN_ORDER; k < BUDDY_ORDERS; ++k) {
+    size_t at = k == BUDDY_MIN_ORDER
+                    ? 0
+                    : buddy.map_at_[k - 1] + BUDDY_MAP_WORDS(k - 1);
+    size_t dirty = (buddy.high_ >> k) / 32 + 1;
+    buddy.map_at_[k] = at;
+    memset(&buddy_map[at], 0, dirty * sizeof(unsigned int));
+  }
+  buddy.orders_ = 0;
+  memset(buddy.lists_, 0, sizeof(buddy.lists_));
+  buddy.end_ = buddy.high_ = mem_heapsize();
+#ifdef DEBUG
+  buddy.checks_ = 0;
+  assert(buddy.map_at_[BUDDY_MAX_ORDER] + BUDDY_MAP_WORDS(BUDDY_MAX_ORDER) <=
+         sizeof(buddy_map) / sizeof(buddy_map[0]));
+#endif
+  return 0;
+}
+
+/*
+ * mm_malloc - Take a block of the smallest order that holds size bytes.
+ */
+void *mm_malloc(size_t size) {
+  if (size == 0 || size > (static_cast(1, size_t) << BUDDY_MAX_ORDER) -
+                              hdr_sz()) {
+    return NULL;
+  }
+  size_t k = order_of(size + hdr_sz());
+  size_t off = find_blk(k);
+  if (off == static_cast(-1, size_t)) {
+    off = grow_heap(k);
+    if (off == static_cast(-1, size_t)) {
+      return NULL;
+    }
+  }
+  static_cast(blk_at(off), size_t *)[0] = k;
+  check();
+  return blk_at(off) + hdr_sz();
+}
+
+/*
+ * mm_free - Merge the block with its buddy as long as the buddy is free.
+ */
+void mm_free(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  void *blk = ptr - hdr_sz();
+  free_blk(blk_off(blk), blk_order(blk));
+  check();
+}
+
+/*
+ * mm_realloc - Keep the block if it is still of the right order, give
+ *     back its upper halves when it shrinks, and take its upper buddies
+ *     when they are free(or past the end of the heap); move it otherwise.
+ */
+void *mm_realloc(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return mm_malloc(size);
+  }
+  if (size == 0) {
+    mm_free(ptr);
+    return NULL;
+  }
+  if (size > (static_cast(1, size_t) << BUDDY_MAX_ORDER) - hdr_sz()) {
+    return NULL;
+  }
+  void *blk = ptr - hdr_sz();
+  size_t off = blk_off(blk);
+  size_t k = blk_order(blk);
+  size_t want = order_of(size + hdr_sz());
+  if (want < k) {
+    // free the upper halves; their buddies are in use.
+    for (size_t j = k; j > want; --j) {
+      free_blk(off + (static_cast(1, size_t) << (j - 1)), j - 1);
+    }
+    static_cast(blk, size_t *)[0] = want;
+    check();
+    return ptr;
+  }
+  if (want > k && (off & ((static_cast(1, size_t) << want) - 1)) == 0) {
+    // blk is the lower half of each block up to order want; see whether
+    // every upper half is free, or past the end of the heap.
+    size_t j = k;
+    while (j < want) {
+      size_t upper = off + (static_cast(1, size_t) << j);
+      if (upper < buddy.end_ && !is_free(upper, j)) {
+        break;
+      }
+      ++j;
+    }
+    size_t top = off + (static_cast(1, size_t) << want);
+    if (j == want &&
+        (top <= buddy.end_ || mem_sbrk(top - buddy.end_) != (void *)-1)) {
+      for (j = k; j < want; ++j) {
+        size_t upper = off + (static_cast(1, size_t) << j);
+        if (upper < buddy.end_) {
+          remove_blk(upper, j);
+        }
+      }
+      if (top > buddy.end_) {
+        buddy.end_ = top;
+        buddy.high_ = top > buddy.high_ ? top : buddy.high_;
+      }
+      k = want;
+      static_cast(blk, size_t *)[0] = k;
+    }
+  }
+  if (want <= k) {
+    check();
+    return ptr;
+  }
+  void *res = mm_malloc(size);
+  if (res != NULL) {
+    memcpy(res, ptr, (static_cast(1, size_t) << k) - hdr_sz());
+    mm_free(ptr);
+  }
+  return res;
+}
+
+/************************************************
+ * Helper Functions Implementation
+ ************************************************/
+
+static inline size_t order_of(size_t size) {
+  if (size <= (static_cast(1, size_t) << BUDDY_MIN_ORDER)) {
+    return BUDDY_MIN_ORDER;
+  }
+  return sizeof(unsigned long) * 8 - __builtin_clzl(size - 1);
+}
+
+static inline int is_free(size_t off, size_t k) {
+  size_t bit = off >> k;
+  return (buddy_map[buddy.map_at_[k] + bit / 32] >> (bit % 32)) & 1;
+}
+
+static inline void mark(size_t off, size_t k, int free) {
+  size_t bit = off >> k;
+  unsigned int *word = &buddy_map[buddy.map_at_[k] + bit / 32];
+  if (free) {
+    *word |= 1U << (bit % 32);
+  } else {
+    *word &= ~(1U << (bit % 32));
+  }
+}
+
+/**
+ * @return the link to the block at offset off.
+ */
+static inline unsigned int link_of(void *blk) {
+  return blk == MMEOL
+             ? 0
+             : static_cast(blk_off(blk) >> BUDDY_MIN_ORDER, unsigned int) + 1;
+}
+
+/**
+ * @return the block a link points to, MMEOL for 0.
+ */
+static inline void *link_at(unsigned int link) {
+  return link == 0
+             ? MMEOL
+             : blk_at(static_cast(link - 1, size_t) << BUDDY_MIN_ORDER);
+}
+
+static void free_blk(size_t off, size_t k) {
+  // merge with the buddy while it is free.
+  while (k < BUDDY_MAX_ORDER) {
+    size_t mate = off ^ (static_cast(1, size_t) << k);
+    if (mate >= buddy.end_ || !is_free(mate, k)) {
+      break;
+    }
+    remove_blk(mate, k);
+    off &= ~(static_cast(1, size_t) << k);
+    ++k;
+  }
+  void *blk = blk_at(off);
+  struct free_meta *meta = static_cast(blk, struct free_meta *);
+  void *head = buddy.lists_[k];
+  meta->order_ = k | BUDDY_FREE;
+  meta->prev_ = 0;
+  meta->next_ = link_of(head);
+  if (head != MMEOL) {
+    static_cast(head, struct free_meta *)->prev_ = link_of(blk);
+  }
+  buddy.lists_[k] = blk;
+  buddy.orders_ |= 1UL << k;
+  mark(off, k, 1);
+}
+
+static void remove_blk(size_t off, size_t k) {
+  void *blk = blk_at(off);
+  struct free_meta *meta = static_cast(blk, struct free_meta *);
+  struct free_meta *prev = link_at(meta->prev_);
+  struct free_meta *next = link_at(meta->next_);
+#ifdef DEBUG
+  assert(meta->order_ == (k | BUDDY_FREE) && is_free(off, k));
+#endif
+  if (prev != MMEOL) {
+    prev->next_ = meta->next_;
+  } else {
+    buddy.lists_[k] = next;
+    if (next == MMEOL) {
+      buddy.orders_ &= ~(1UL << k);
+    }
+  }
+  if (next != MMEOL) {
+    next->prev_ = meta->prev_;
+  }
+  mark(off, k, 0);
+}
+
+static size_t find_blk(size_t k) {
+  unsigned long orders = buddy.orders_ & (~0UL << k);
+  if (orders == 0) {
+    return static_cast(-1, size_t);
+  }
+  size_t j = __builtin_ctzl(orders);
+  size_t off = blk_off(buddy.lists_[j]);
+  remove_blk(off, j);
+  // give back the upper halves, down to order k.
+  while (j > k) {
+    --j;
+    free_blk(off + (static_cast(1, size_t) << j), j);
+  }
+  return off;
+}
+
+static size_t grow_heap(size_t k) {
+  size_t size = static_cast(1, size_t) << k;
+  size_t end = buddy.end_;
+  size_t start = (end + size - 1) & ~(size - 1);
+  if (mem_sbrk(start + size - end) == (void *)-1) {
+    return static_cast(-1, size_t);
+  }
+  buddy.end_ = start + size;
+  buddy.high_ = buddy.end_ > buddy.high_ ? buddy.end_ : buddy.high_;
+  // the gap up to start becomes free blocks, each as large as its
+  // alignment allows.
+  while (end < start) {
+    size_t j = end == 0 ? k : static_cast(__builtin_ctzl(end), size_t);
+    while ((static_cast(1, size_t) << j) > start - end) {
+      --j;
+    }
+    free_blk(end, j);
+    end += static_cast(1, size_t) << j;
+  }
+  return start;
+}
+
+#ifdef DEBUG
+/**
+ * @return non zero if the heap or the lists are inconsistent.
+ */
+static int check_heap(void) {
+  size_t nfree = 0;
+  size_t off = 0;
+  while (off < buddy.end_) {
+    void *blk = blk_at(off);
+    size_t k = blk_order(blk);
+    int free = (static_cast(blk, size_t *)[0] & BUDDY_FREE) != 0;
+    if (k < BUDDY_MIN_ORDER || k > BUDDY_MAX_ORDER ||
+        (off & ((static_cast(1, size_t) << k) - 1)) != 0) {
+      fprintf(stderr, "Block at %zu has a bad order %zu\n", off, k);
+      return -1;
+    }
+    if (free != is_free(off, k)) {
+      fprintf(stderr, "Block at %zu disagrees with the bitmap\n", off);
+      return -1;
+    }
+    size_t mate = off ^ (static_cast(1, size_t) << k);
+    if (free && mate < buddy.end_ && is_free(mate, k)) {
+      fprintf(stderr, "Block at %zu was not merged with its buddy\n", off);
+      return -1;
+    }
+    nfree += free;
+    off += static_cast(1, size_t) << k;
+  }
+  if (off != buddy.end_ || buddy.end_ != mem_heapsize()) {
+    fprintf(stderr, "The blocks do not end at the end of the heap\n");
+    return -1;
+  }
+  size_t nlisted = 0;
+  for (size_t k = 0; k < BUDDY_ORDERS; ++k) {
+    if (((buddy.orders_ >> k) & 1) != (buddy.lists_[k] != MMEOL)) {
+      fprintf(stderr, "lists_[%zu] disagrees with orders_\n", k);
+      return -1;
+    }
+    for (void *it = buddy.lists_[k]; it != MMEOL;
+         it = link_at(static_cast(it, struct free_meta *)->next_)) {
+      if (static_cast(it, size_t *)[0] != (k | BUDDY_FREE)) {
+        fprintf(stderr, "lists_[%zu] holds a bad block %p\n", k, it);
+        return -1;
+      }
+      ++nlisted;
+    }
+  }
+  if (nlisted != nfree) {
+    fprintf(stderr, "%zu free blocks, but %zu on the lists\n", nfree,
+            nlisted);
+    return -1;
+  }
+  return 0;
+}
+#endif
+
+static void check(void) {
+#ifdef DEBUG
+  if (++buddy.checks_ >= MM_CHECK_PERIOD) {
+    buddy.checks_ = 0;
+    assert(check_heap() == 0);
+  }
+#endif
+}
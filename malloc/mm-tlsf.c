@@ -0,0 +1,585 @@
+/*
+ * mm-tlsf.c - a Two-Level Segregated Fit allocator, for callers that need
+ * malloc and free to take bounded time.
+ *
+ * Free blocks are kept on one doubly linked list per size class. The first
+ * level splits sizes by powers of two, the second splits each power of two
+ * into 2^TLSF_SL_SHIFT classes, and a bitmap per level marks the non-empty
+ * lists. A request is rounded up to the next class boundary before the
+ * search, so that every block of the class found fits: malloc takes the
+ * head of the list that two bit scans point at, and never walks a list.
+ * Free blocks are merged with both neighbors at once, through boundary
+ * tags. So apart from mem_sbrk, mm_malloc and mm_free run in O(1), at the
+ * cost of the internal fragmentation of rounding up.
+ *
+ * Block layout(sizes include meta, and are multiples of ALIGNMENT):
+ *   used block: [size | payload ... ]
+ *   free block: [size | next | prev | ... | size ]
+ * The low bits of size are TLSF_FREE and TLSF_PREV_FREE; next and prev are
+ * offsets from the first byte of the heap, 0 for none. The heap starts
+ * with a prologue word and ends with an epilogue header of size 0.
+ *
+ * Build it with "make mdriver-tlsf".
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+team_t team = {
+    /* Team name */
+    "fdyrd",
+    /* First member's full name */
+    "Rundong Yang",
+    /* First member's email address */
+    "yangrundong7@gmail.com",
+    /* Second member's full name (leave blank if none) */
+    "",
+    /* Second member's email address (leave blank if none) */
+    ""};
+
+/* single word (4) or double word (8) alignment */
+#define ALIGNMENT 8
+
+/* rounds up to the nearest multiple of ALIGNMENT */
+#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~0x7)
+
+/**
+ * Size classes. Sizes below TLSF_SMALL are split evenly by ALIGNMENT into
+ * first level 0; every power of two 2^f above is first level
+ * f - TLSF_FL_SHIFT + 1, split into TLSF_SL_COUNT classes.
+ */
+#define TLSF_SL_SHIFT 4
+#define TLSF_SL_COUNT (1U << TLSF_SL_SHIFT)
+#define TLSF_FL_SHIFT (TLSF_SL_SHIFT + 3)
+#define TLSF_SMALL (1U << TLSF_FL_SHIFT)
+#define TLSF_FL_COUNT (32 - TLSF_FL_SHIFT + 1)
+
+/** requests larger than this are refused, so that sizes fit the classes */
+#define TLSF_MAX_REQUEST (1U << 30)
+
+/** tags in the low bits of size */
+#define TLSF_FREE 0x1
+#define TLSF_PREV_FREE 0x2
+#define TLSF_TAGS 0x7
+
+/**
+ * With DEBUG, every operation checks the blocks it touched, and every
+ * MM_CHECK_PERIOD operations the whole heap is checked.
+ */
+#ifndef MM_CHECK_PERIOD
+#define MM_CHECK_PERIOD 256
+#endif
+
+/** Layout of free block: [size | next | prev | ... | size ] */
+struct free_meta {
+  size_t size_;       // size of entire block(including meta) and tags
+  unsigned int next_; // successor in the free list
+  unsigned int prev_; // predecessor in the free list
+};
+
+/** Everything that tracks the free blocks. */
+struct control {
+  /** bit f is set iff sl_map_[f] is non-zero */
+  unsigned int fl_map_;
+  /** bit s of sl_map_[f] is set iff lists_[f][s] is non-empty */
+  unsigned int sl_map_[TLSF_FL_COUNT];
+  /** heads of the free lists */
+  void *lists_[TLSF_FL_COUNT][TLSF_SL_COUNT];
+#ifdef DEBUG
+  /** operations since the last full check */
+  unsigned int checks_;
+#endif
+};
+
+static struct control tlsf;
+
+/** first byte of the heap; list links are offsets from here */
+static void *tlsf_base;
+
+/** Utility macros */
+#define static_cast(a, Tp) ((Tp)(a))
+
+/** end of list */
+#define MMEOL ((void *)0)
+
+/**
+ * @return size of the meta of a used block, which is its header.
+ */
+static inline size_t hdr_sz(void) { return ALIGN(sizeof(size_t)); }
+
+/**
+ * @return size of the smallest block, which must hold a free block's meta.
+ */
+static inline size_t min_blk_sz(void) {
+  return ALIGN(sizeof(struct free_meta) + sizeof(size_t));
+}
+
+/************************************************
+ * Helper Functions Prototypes
+ ************************************************/
+
+/**
+ * @return size of the block at blk(including meta).
+ */
+static inline size_t blk_size(void *blk);
+
+/**
+ * @brief set the size of the block at blk, and keep its tags.
+ */
+static inline void set_size(void *blk, size_t size);
+
+/**
+ * @return the block right after blk.
+ */
+static inline void *next_blk(void *blk);
+
+/**
+ * @brief write the footer of the free block blk, and tell the block after
+ * it that blk is free.
+ */
+static void mark_free(void *blk);
+
+/**
+ * @brief tag blk as used, and tell the block after it.
+ */
+static void mark_used(void *blk);
+
+/**
+ * @brief first and second level of the class of a block of size bytes.
+ */
+static inline void mapping(size_t size, size_t *fl, size_t *sl);
+
+/**
+ * @brief add the free block blk to the head of the list of its class.
+ */
+static void insert_blk(void *blk);
+
+/**
+ * @brief take the free block blk off its list.
+ */
+static void remove_blk(void *blk);
+
+/**
+ * @brief find a free block of at least size bytes, and take it off its
+ * list. Only the heads of lists are looked at.
+ * @return MMEOL if there is none.
+ */
+static void *find_blk(size_t size);
+
+/**
+ * @brief cut blk down to size bytes, and free what is left if it can be a
+ * block.
+ */
+static void split_blk(void *blk, size_t size);
+
+/**
+ * @brief merge the free block blk with its free neighbors; none of them
+ * may be on a list.
+ * @return the merged block.
+ */
+static void *merge_blk(void *blk);
+
+/**
+ * @brief grow the heap so that its last block is a free block of at least
+ * size bytes, which is not on any list.
+ * @return the block, MMEOL if the heap can not grow.
+ */
+static void *grow_heap(size_t size);
+
+/**
+ * @brief with DEBUG, check blk against its neighbors, and the whole heap
+ * once every MM_CHECK_PERIOD calls.
+ */
+static void check(void *blk);
+
+/**
+ * @return the smallest block that holds a request of size bytes.
+ */
+static inline size_t blk_need(size_t size) {
+  size_t need = ALIGN(size + hdr_sz());
+  return need > min_blk_sz() ? need : min_blk_sz();
+}
+
+/*
+ * mm_init - initialize the malloc package.
+ */
+int mm_init(void) {
+  memset(&tlsf, 0, sizeof(tlsf));
+  // a prologue word, so that no block is at offset 0, and the epilogue.
+  tlsf_base = mem_sbrk(ALIGNMENT + hdr_sz());
+  if (tlsf_base == (void *)-1) {
+    return -1;
+  }
+  static_cast(tlsf_base, size_t *)[0] = ALIGNMENT;
+  static_cast(tlsf_base + ALIGNMENT, size_t *)[0] = 0;
+  return 0;
+}
+
+/*
+ * mm_malloc - Take the head of the first non-empty list whose blocks all
+ *     fit, or grow the heap.
+ */
+void *mm_malloc(size_t size) {
+  if (size == 0 || size > TLSF_MAX_REQUEST) {
+    return NULL;
+  }
+  size_t need = blk_need(size);
+  void *blk = find_blk(need);
+  if (blk == MMEOL) {
+    blk = grow_heap(need);
+    if (blk == MMEOL) {
+      return NULL;
+    }
+  }
+  split_blk(blk, need);
+  mark_used(blk);
+  check(blk);
+  return blk + hdr_sz();
+}
+
+/*
+ * mm_free - Merge the block with its free neighbors, and put it on the
+ *     list of its class.
+ */
+void mm_free(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  void *blk = merge_blk(ptr - hdr_sz());
+  insert_blk(blk);
+  check(blk);
+}
+
+/*
+ * mm_realloc - Resize the block in place when it shrinks, when its right
+ *     neighbor is free and large enough, or when it is the last block;
+ *     move it otherwise.
+ */
+void *mm_realloc(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return mm_malloc(size);
+  }
+  if (size == 0) {
+    mm_free(ptr);
+    return NULL;
+  }
+  if (size > TLSF_MAX_REQUEST) {
+    return NULL;
+  }
+  void *blk = ptr - hdr_sz();
+  size_t need = blk_need(size);
+  void *next = next_blk(blk);
+  size_t word = static_cast(next, size_t *)[0];
+  if (blk_size(blk) < need && (word & TLSF_FREE) != 0 &&
+      blk_size(blk) + blk_size(next) >= need) {
+    // absorb the right neighbor.
+    remove_blk(next);
+    set_size(blk, blk_size(blk) + blk_size(next));
+    mark_used(blk);
+  } else if (blk_size(blk) < need && blk_size(next) == 0) {
+    // the last block: grow the heap under it.
+    if (mem_sbrk(need - blk_size(blk)) == (void *)-1) {
+      return NULL;
+    }
+    set_size(blk, need);
+    static_cast(next_blk(blk), size_t *)[0] = 0;
+  }
+  if (blk_size(blk) >= need) {
+    split_blk(blk, need);
+    check(blk);
+    return ptr;
+  }
+  void *res = mm_malloc(size);
+  if (res != NULL) {
+    memcpy(res, ptr, blk_size(blk) - hdr_sz());
+    mm_free(ptr);
+  }
+  return res;
+}
+
+/************************************************
+ * Helper Functions Implementation
+ ************************************************/
+
+static inline size_t blk_size(void *blk) {
+  return static_cast(blk, size_t *)[0] & ~static_cast(TLSF_TAGS, size_t);
+}
+
+static inline void set_size(void *blk, size_t size) {
+  size_t *word = static_cast(blk, size_t *);
+  *word = size | (*word & TLSF_TAGS);
+}
+
+static inline void *next_blk(void *blk) { return blk + blk_size(blk); }
+
+/**
+ * @return the block at offset off of the heap, MMEOL if off is 0.
+ */
+static inline void *blk_at(unsigned int off) {
+  return off == 0 ? MMEOL : tlsf_base + off;
+}
+
+/**
+ * @return offset of blk from the start of the heap, 0 for MMEOL.
+ */
+static inline unsigned int blk_off(void *blk) {
+  return blk == MMEOL ? 0 : static_cast(blk - tlsf_base, unsigned int);
+}
+
+static void mark_free(void *blk) {
+  size_t *word = static_cast(blk, size_t *);
+  *word |= TLSF_FREE;
+  static_cast(next_blk(blk) - sizeof(size_t), size_t *)[0] = blk_size(blk);
+  static_cast(next_blk(blk), size_t *)[0] |= TLSF_PREV_FREE;
+}
+
+static void mark_used(void *blk) {
+  static_cast(blk, size_t *)[0] &= ~static_cast(TLSF_FREE, size_t);
+  static_cast(next_blk(blk), size_t *)[0] &=
+      ~static_cast(TLSF_PREV_FREE, size_t);
+}
+
+/**
+ * @return index of the most significant set bit of a non-zero x.
+ */
+static inline size_t msb(size_t x) {
+  return sizeof(unsigned long) * 8 - 1 - __builtin_clzl(x);
+}
+
+static inline void mapping(size_t size, size_t *fl, size_t *sl) {
+  if (size < TLSF_SMALL) {
+    *fl = 0;
+    *sl = size / ALIGNMENT;
+    return;
+  }
+  size_t f = msb(size);
+  *fl = f - TLSF_FL_SHIFT + 1;
+  *sl = (size >> (f - TLSF_SL_SHIFT)) ^ TLSF_SL_COUNT;
+}
+
+static void insert_blk(void *blk) {
+  size_t fl, sl;
+  mapping(blk_size(blk), &fl, &sl);
+  struct free_meta *meta = static_cast(blk, struct free_meta *);
+  void *head = tlsf.lists_[fl][sl];
+  meta->prev_ = 0;
+  meta->next_ = blk_off(head);
+  if (head != MMEOL) {
+    static_cast(head, struct free_meta *)->prev_ = blk_off(blk);
+  }
+  tlsf.lists_[fl][sl] = blk;
+  tlsf.sl_map_[fl] |= 1U << sl;
+  tlsf.fl_map_ |= 1U << fl;
+}
+
+static void remove_blk(void *blk) {
+  struct free_meta *meta = static_cast(blk, struct free_meta *);
+  struct free_meta *prev = blk_at(meta->prev_);
+  struct free_meta *next = blk_at(meta->next_);
+  if (prev != MMEOL) {
+    prev->next_ = meta->next_;
+  }
+  if (next != MMEOL) {
+    next->prev_ = meta->prev_;
+  }
+  if (prev == MMEOL) {
+    // blk is the head of its list.
+    size_t fl, sl;
+    mapping(blk_size(blk), &fl, &sl);
+#ifdef DEBUG
+    assert(tlsf.lists_[fl][sl] == blk);
+#endif
+    tlsf.lists_[fl][sl] = next;
+    if (next == MMEOL) {
+      tlsf.sl_map_[fl] &= ~(1U << sl);
+      if (tlsf.sl_map_[fl] == 0) {
+        tlsf.fl_map_ &= ~(1U << fl);
+      }
+    }
+  }
+  meta->next_ = meta->prev_ = 0;
+}
+
+static void *find_blk(size_t size) {
+  if (size >= TLSF_SMALL) {
+    // round up to the next class, whose blocks are all large enough.
+    size += (static_cast(1, size_t) << (msb(size) - TLSF_SL_SHIFT)) - 1;
+  }
+  size_t fl, sl;
+  mapping(size, &fl, &sl);
+  if (fl >= TLSF_FL_COUNT) {
+    return MMEOL;
+  }
+  unsigned int sl_map = tlsf.sl_map_[fl] & (~0U << sl);
+  if (sl_map == 0) {
+    // nothing left in this power of two, go to the next non-empty one.
+    unsigned int fl_map = fl + 1 < 32 ? tlsf.fl_map_ & (~0U << (fl + 1)) : 0;
+    if (fl_map == 0) {
+      return MMEOL;
+    }
+    fl = __builtin_ctz(fl_map);
+    sl_map = tlsf.sl_map_[fl];
+  }
+  sl = __builtin_ctz(sl_map);
+  void *blk = tlsf.lists_[fl][sl];
+  remove_blk(blk);
+  return blk;
+}
+
+static void split_blk(void *blk, size_t size) {
+  size_t total = blk_size(blk);
+  if (total - size < min_blk_sz()) {
+    return;
+  }
+  set_size(blk, size);
+  void *rest = next_blk(blk);
+  // blk is in use, or about to be.
+  static_cast(rest, size_t *)[0] = total - size;
+  rest = merge_blk(rest);
+  insert_blk(rest);
+}
+
+static void *merge_blk(void *blk) {
+  void *next = next_blk(blk);
+  if ((static_cast(next, size_t *)[0] & TLSF_FREE) != 0) {
+    remove_blk(next);
+    set_size(blk, blk_size(blk) + blk_size(next));
+  }
+  if ((static_cast(blk, size_t *)[0] & TLSF_PREV_FREE) != 0) {
+    void *prev = blk - static_cast(blk - sizeof(size_t), size_t *)[0];
+    remove_blk(prev);
+    set_size(prev, blk_size(prev) + blk_size(blk));
+    blk = prev;
+  }
+  mark_free(blk);
+  return blk;
+}
+
+static void *grow_heap(size_t size) {
+  // the epilogue becomes the header of the new block.
+  void *end = mem_heap_hi() + 1 - hdr_sz();
+  size_t more = size;
+  void *blk = end;
+  if ((static_cast(end, size_t *)[0] & TLSF_PREV_FREE) != 0) {
+    // the last block is free; grow it instead.
+    blk = end - static_cast(end - sizeof(size_t), size_t *)[0];
+    remove_blk(blk);
+    if (blk_size(blk) >= size) {
+      // find_blk skipped it, as its class holds smaller blocks too.
+      return blk;
+    }
+    more = size - blk_size(blk);
+  }
+  if (mem_sbrk(more) == (void *)-1) {
+    if (blk != end) {
+      insert_blk(blk);
+    }
+    return MMEOL;
+  }
+  if (blk == end) {
+    static_cast(blk, size_t *)[0] = size;
+  } else {
+    set_size(blk, size);
+  }
+  static_cast(next_blk(blk), size_t *)[0] = 0;
+  mark_free(blk);
+  return blk;
+}
+
+#ifdef DEBUG
+/**
+ * @return non zero if blk disagrees with its right neighbor.
+ */
+static int check_blk(void *blk) {
+  size_t word = static_cast(blk, size_t *)[0];
+  void *next = next_blk(blk);
+  size_t next_word = static_cast(next, size_t *)[0];
+  if ((blk_size(blk) & (ALIGNMENT - 1)) != 0 ||
+      blk_size(blk) < min_blk_sz()) {
+    fprintf(stderr, "Block %p has a bad size %zu\n", blk, blk_size(blk));
+    return -1;
+  }
+  if (((word & TLSF_FREE) != 0) != ((next_word & TLSF_PREV_FREE) != 0)) {
+    fprintf(stderr, "Block %p disagrees with its right neighbor\n", blk);
+    return -1;
+  }
+  if ((word & TLSF_FREE) != 0) {
+    if ((next_word & TLSF_FREE) != 0) {
+      fprintf(stderr, "Free block %p was not merged\n", blk);
+      return -1;
+    }
+    if (static_cast(next - sizeof(size_t), size_t *)[0] != blk_size(blk)) {
+      fprintf(stderr, "Free block %p has a bad footer\n", blk);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @return non zero if the heap or the lists are inconsistent.
+ */
+static int check_heap(void) {
+  size_t nfree = 0;
+  void *blk = tlsf_base + ALIGNMENT;
+  for (; blk_size(blk) != 0; blk = next_blk(blk)) {
+    if (check_blk(blk) != 0) {
+      return -1;
+    }
+    nfree += (static_cast(blk, size_t *)[0] & TLSF_FREE) != 0;
+  }
+  if (blk != mem_heap_hi() + 1 - hdr_sz()) {
+    fprintf(stderr, "The epilogue %p is not at the end of the heap\n", blk);
+    return -1;
+  }
+  size_t nlisted = 0;
+  for (size_t fl = 0; fl < TLSF_FL_COUNT; ++fl) {
+    if (((tlsf.fl_map_ >> fl) & 1) != (tlsf.sl_map_[fl] != 0)) {
+      fprintf(stderr, "fl_map_ disagrees with sl_map_[%zu]\n", fl);
+      return -1;
+    }
+    for (size_t sl = 0; sl < TLSF_SL_COUNT; ++sl) {
+      void *head = tlsf.lists_[fl][sl];
+      if (((tlsf.sl_map_[fl] >> sl) & 1) != (head != MMEOL)) {
+        fprintf(stderr, "lists_[%zu][%zu] disagrees with the bitmap\n", fl,
+                sl);
+        return -1;
+      }
+      for (void *it = head; it != MMEOL;
+           it = blk_at(static_cast(it, struct free_meta *)->next_)) {
+        size_t f, s;
+        mapping(blk_size(it), &f, &s);
+        if (f != fl || s != sl ||
+            (static_cast(it, size_t *)[0] & TLSF_FREE) == 0) {
+          fprintf(stderr, "lists_[%zu][%zu] holds a bad block %p\n", fl, sl,
+                  it);
+          return -1;
+        }
+        ++nlisted;
+      }
+    }
+  }
+  if (nlisted != nfree) {
+    fprintf(stderr, "%zu free blocks, but %zu on the lists\n", nfree,
+            nlisted);
+    return -1;
+  }
+  return 0;
+}
+#endif
+
+static void check(void *blk) {
+#ifdef DEBUG
+  assert(check_blk(blk) == 0);
+  if (++tlsf.checks_ >= MM_CHECK_PERIOD) {
+    tlsf.checks_ = 0;
+    assert(check_heap() == 0);
+  }
+#else
+  (void)blk;
+#endif
+}
@@ -1,22 +1,67 @@
 /*
- * mm-naive.c - The fastest, least memory-efficient malloc package.
+ * mm.c - segregated-fit malloc package.
  *
- * In this naive approach, a block is allocated by simply incrementing
- * the brk pointer.  A block is pure payload. There are no headers or
- * footers.  Blocks are never coalesced or reused. Realloc is
- * implemented directly using mm_malloc and mm_free.
+ * Every block starts with a one-word header holding its size; the low 3
+ * bits are tags telling whether the block and its left neighbor are in
+ * use. Only free blocks carry a footer(a copy of the size), which is how
+ * a block finds a free left neighbor to coalesce with. Free blocks
+ * smaller than MM_TREE_MIN are kept on one doubly linked list per size
+ * class; classes are 4 per power of two, so the class of a size is found
+ * by a single bit-scan of it (see size_class). Larger free blocks are
+ * indexed by a splay tree keyed by (size, address), which gives best fit
+ * in O(log n). List and tree links are 32-bit offsets from mem_heap_lo().
+ * Freed blocks are coalesced with both neighbors immediately, and end_blk_
+ * always points to the last block in the heap.
  *
- * NOTE TO STUDENTS: Replace this header comment with your own header
- * comment that gives a high level description of your solution.
+ * Requests smaller than MM_SLAB_MAX never reach the blocks above: they are
+ * served from slabs, pages carved into equal slots that carry no header at
+ * all. mm_slab_map tells which pages of the heap are slabs.
+ *
+ * Small blocks that are freed go to fast bins first: exact-size LIFO lists
+ * whose blocks stay marked as used, so that a malloc of the same size takes
+ * them back without any split or coalescing. The fast bins are consolidated,
+ * i.e. freed for real, when a large request comes, when a request can't be
+ * served without growing the heap, or when they hold too many bytes.
+ *
+ * Built with -DMM_THREADS, everything above is an arena, and there are
+ * MM_ARENAS of them, each behind a lock of its own and each carving its
+ * blocks out of its own chunks of the memlib heap. Threads are spread over
+ * the arenas round-robin and move on when their arena is contended; a block
+ * is always freed to the arena that owns its chunk: by the threads of that
+ * arena under its lock, by other threads onto a lock-free stack the arena
+ * drains later. In front of the arenas each thread caches small payloads.
+ *
+ * Requests of MM_MMAP_THRESHOLD bytes and up stay out of all of this: each
+ * gets a mapping of its own, which is unmapped as soon as it is freed and
+ * resized with mremap, so that it never has to be copied.
+ *
+ * On top of all that, a region(mm_region_create) hands out the bytes of
+ * large chunks from mm_malloc by bumping a pointer, and gives them all back
+ * at once: its objects have no header and are never freed one by one. A
+ * pool(mm_pool_create) hands out objects of a single size from slabs of
+ * its own, linked through their first word while free; under MM_THREADS
+ * each thread keeps a magazine of them per pool.
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // mremap
+#endif
 #include <assert.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include "config.h"
+#ifdef MM_PROFILE
+#include "heapmap.h"
+#endif
 #include "memlib.h"
 #include "mm.h"
+#include "mm_classes.h"
 
 /*********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please
@@ -42,40 +87,468 @@ team_t team = {
 
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
-/** last block of each free list and used list */
-void *end_blk;
+/** first byte of the heap; list and tree links are offsets from here */
+void *mm_base;
+
+/**
+ * Size classes. Sizes below MM_CLASS_LINEAR are split evenly by ALIGNMENT,
+ * every power of two above is split into 2^MM_CLASS_SHIFT classes, e.g.
+ *   [32, 40) [40, 48) [48, 56) [56, 64) [64, 80) ... [896, 1024)
+ * Blocks of MM_TREE_MIN bytes and up are not in any class but in tree_.
+ * MM_CLASS_SHIFT and MM_TREE_SHIFT, as well as MM_SLAB_MAX and MM_FAST_MAX
+ * below, come from mm_classes.h, which mkclasses picks from the traces;
+ * mm_class_min there lists the smallest block size of each class.
+ */
+#define MM_CLASS_LINEAR (ALIGNMENT << MM_CLASS_SHIFT)
+#define MM_TREE_MIN (1U << MM_TREE_SHIFT)
+#define MM_NUM_CLASSES                                                         \
+  ((MM_TREE_SHIFT - MM_CLASS_SHIFT - 3 + 1) << MM_CLASS_SHIFT)
+
+/**
+ * Number of blocks find_fit examines in the class of the request before
+ * mm_malloc moves on to the next non-empty class(where any block fits).
+ * This bounds the worst case latency of mm_malloc.
+ */
+#define MM_FIT_PROBES 8
+
+/**
+ * Placement policy of find_fit within a free list, chosen at compile time
+ * with "-DMM_FIT=<policy>":
+ *   MM_FIT_FIRST   the first block that fits; lists are LIFO.
+ *   MM_FIT_NEXT    the first block that fits after where the last search
+ *                  of the list ended(its rover).
+ *   MM_FIT_ADDRESS the first block that fits; lists are kept in address
+ *                  order, which costs a walk of the list on every insert.
+ *   MM_FIT_BEST    the smallest block that fits among MM_FIT_PROBES.
+ * Blocks of tree_ are always fitted best.
+ */
+#define MM_FIT_FIRST 0
+#define MM_FIT_NEXT 1
+#define MM_FIT_ADDRESS 2
+#define MM_FIT_BEST 3
+#ifndef MM_FIT
+#define MM_FIT MM_FIT_FIRST
+#endif
+
+/**
+ * With DEBUG, every operation checks the blocks it touched against their
+ * neighbors, which is O(1), and every MM_CHECK_PERIOD operations of an
+ * arena run the full mm_check, which walks the whole heap.
+ */
+#ifndef MM_CHECK_PERIOD
+#define MM_CHECK_PERIOD 256
+#endif
+
+/**
+ * Slabs. A slab is the payload of a used block, aligned to MM_SLAB_SIZE so
+ * that the slab of a slot is found by masking the address of the slot.
+ * There is one slab class per multiple of ALIGNMENT below MM_SLAB_MAX.
+ * The traces rarely keep more than a few dozen tiny objects alive, so a
+ * slab is a 1KB page rather than a 4KB one.
+ */
+#define MM_SLAB_SHIFT 10
+#define MM_SLAB_SIZE (1U << MM_SLAB_SHIFT)
+#define MM_SLAB_CLASSES (MM_SLAB_MAX / ALIGNMENT)
+
+/** bit i is set iff the i-th MM_SLAB_SIZE page of the heap is a slab */
+unsigned int mm_slab_map[(HEAP_LIMIT / MM_SLAB_SIZE + 1) / 32 + 1];
+
+/**
+ * Growth and trimming. When no free block fits, the heap grows by at least
+ * 1/2^MM_GROW_SHIFT of its size, so that it takes a number of mem_sbrk
+ * calls logarithmic in its size to get there. A free end_blk_ larger than
+ * twice that step(and than MM_TRIM_MIN) is cut back to one step, and the
+ * rest goes back to memlib; the gap in between keeps the heap from
+ * bouncing up and down. Other free blocks of MM_RELEASE_MIN bytes and up
+ * keep their place, but give their pages back with madvise once they have
+ * sat idle for a while: a page given back right away is all too often
+ * faulted in again by the next malloc. Time is counted in epochs, each of
+ * which ends once MM_RELEASE_EPOCH bytes have been freed into such blocks;
+ * at the end of an epoch, the blocks that have been in the tree since the
+ * epoch before last, untouched, give their pages back.
+ */
+#define MM_GROW_SHIFT 7
+#define MM_TRIM_MIN (1 << 17)
+#define MM_RELEASE_MIN (1 << 20)
+#define MM_RELEASE_EPOCH (1 << 22)
+/** epoch of a tree node whose pages are given back already */
+#define MM_RELEASED (~0U)
+
+/**
+ * Requests of at least this many bytes are mapped on their own. The
+ * default is larger than any request in the traces, whose payloads mdriver
+ * expects to find in the memlib heap.
+ */
+#ifndef MM_MMAP_THRESHOLD
+#define MM_MMAP_THRESHOLD (1U << 20)
+#endif
+
+/**
+ * Fast bins. fast_[size / ALIGNMENT] is the list of cached blocks of
+ * exactly size bytes, for sizes up to MM_FAST_MAX.
+ */
+#define MM_FAST_BINS (MM_FAST_MAX / ALIGNMENT + 1)
+#define MM_FAST_BUDGET (1 << 14)
+
+/**
+ * Regions. A region takes chunks of MM_REGION_CHUNK bytes unless told
+ * otherwise; a request larger than 1/MM_REGION_SOLO of a chunk gets a
+ * chunk of its own, so that the rest of the current chunk is not wasted.
+ */
+#define MM_REGION_CHUNK (1U << 14)
+#define MM_REGION_SOLO 4
+
+/**
+ * Pools. A pool slab is MM_POOL_SLAB bytes, or large enough for
+ * MM_POOL_MIN_OBJS objects, and is aligned to a cache line(MM_POOL_LINE)
+ * and to the objects; its objects start at the first such boundary after
+ * its header, so that objects whose size divides a line never straddle
+ * two. Under MM_THREADS, a magazine takes MM_POOL_BATCH objects from its
+ * pool at a time when it runs dry, and gives MM_POOL_BATCH back at a time
+ * when it holds MM_POOL_MAG.
+ */
+#define MM_POOL_LINE 64
+#define MM_POOL_SLAB (1U << 14)
+#define MM_POOL_MIN_OBJS 8
+#define MM_POOL_BATCH 16
+#define MM_POOL_MAG (2 * MM_POOL_BATCH)
+
+#ifdef MM_STATS
+/**
+ * Counters behind mm_stats, built with -DMM_STATS only. Requests are
+ * counted by the size class of their blocks, plus one class for blocks of
+ * tree_ and one for mapped blocks.
+ */
+#define MM_STAT_CLASSES (MM_NUM_CLASSES + 2)
+struct stats {
+  unsigned long malloc_[MM_STAT_CLASSES];
+  unsigned long free_[MM_STAT_CLASSES];
+  unsigned long realloc_[MM_STAT_CLASSES];
+  unsigned long fit_steps_[MM_FIT_PROBES + 1]; // find_fit calls by blocks seen
+  unsigned long fit_miss_;                     // find_fit calls that failed
+  unsigned long split_;                        // blocks split in two
+  unsigned long coalesce_;                     // free blocks merged
+} mm_stat;
+#ifdef MM_THREADS
+#define MM_STAT(field, n)                                                      \
+  __atomic_fetch_add(&mm_stat.field, n, __ATOMIC_RELAXED)
+#else
+#define MM_STAT(field, n) (mm_stat.field += (n))
+#endif
+#define MM_STAT_BLK(field, ptr)                                                \
+  do {                                                                         \
+    void *blk_ = (ptr);                                                        \
+    if (blk_ != NULL) {                                                        \
+      MM_STAT(field[stat_class(blk_)], 1);                                     \
+    }                                                                          \
+  } while (0)
+#else
+#define MM_STAT(field, n) ((void)0)
+#define MM_STAT_BLK(field, ptr) ((void)0)
+#endif
+
+#ifdef MM_PROFILE
+/**
+ * Allocation sites, built with -DMM_PROFILE only. One in MM_PROFILE_RATE
+ * allocations of a thread records its caller and size in mm_samples, an
+ * open-addressing table keyed by the offset of the block, and tags the
+ * block MM_SAMPLED so that freeing it knows to drop the record. Payloads
+ * of slabs and mapped blocks are not sampled. Under MM_THREADS the tag is
+ * only flipped with the lock of the arena that owns the block held, since
+ * that arena flips MM_PREV_USED in the same word; the lock of the table
+ * is taken after it.
+ */
+#ifndef MM_PROFILE_RATE
+#define MM_PROFILE_RATE 64
+#endif
+#define MM_PROFILE_SHIFT 14
+#define MM_PROFILE_SLOTS (1U << MM_PROFILE_SHIFT)
+struct sample {
+  unsigned int off_;  // offset of the block from mm_base, 0 for none
+  unsigned int size_; // size asked for
+  void *site_;        // return address of the allocating call
+};
+struct sample mm_samples[MM_PROFILE_SLOTS];
+size_t mm_nsamples;
+#ifdef MM_THREADS
+pthread_mutex_t mm_sample_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread unsigned int mm_sample_tick;
+#else
+unsigned int mm_sample_tick;
+#endif
+#endif
+
+/**
+ * An arena is a heap of its own: the blocks it carves out of the memlib
+ * heap, and everything that tracks the free ones. Without MM_THREADS there
+ * is exactly one.
+ */
+struct arena {
+  /** last block of the heap */
+  void *end_blk_;
+
+  /**
+   * Every byte from here up to the footer of end_blk_ is known to be zero,
+   * since it came fresh from mem_sbrk and nothing has been carved out of it.
+   */
+  void *zero_;
+
+  /** heads of the free lists, one per size class */
+  void *bins_[MM_NUM_CLASSES];
+
+#if MM_FIT == MM_FIT_NEXT
+  /** where the next search of each free list starts, MMEOL for its head */
+  void *rover_[MM_NUM_CLASSES];
+#endif
+
+  /**
+   * Two-level bitmap of non-empty free lists(as in TLSF): bit j of
+   * sl_map_[i] is set iff bins_[(i << MM_CLASS_SHIFT) + j] is non-empty,
+   * and bit i of fl_map_ is set iff sl_map_[i] is non-zero.
+   */
+  unsigned int fl_map_;
+  unsigned int sl_map_[MM_NUM_CLASSES >> MM_CLASS_SHIFT];
+
+  /** root of the splay tree of large free blocks */
+  void *tree_;
+
+  /** heads of the lists of slabs that have free slots, one per slab class */
+  void *slabs_[MM_SLAB_CLASSES];
+
+  /** heads of the fast bins */
+  void *fast_[MM_FAST_BINS];
+
+  /** total bytes of blocks in fast bins */
+  size_t fast_bytes_;
+
+  /** current epoch, and bytes freed into blocks of MM_RELEASE_MIN and up
+   * during it */
+  unsigned int epoch_;
+  size_t epoch_freed_;
+
+#ifdef DEBUG
+  /** operations since the last full mm_check */
+  unsigned int checks_;
+#endif
+
+#ifdef MM_THREADS
+  /** end of the newest chunk of the arena, where its epilogue is */
+  void *top_;
+
+  /** guards everything above */
+  pthread_mutex_t lock_;
+
+  /**
+   * Payloads freed by threads of other arenas, linked through their first
+   * word as offsets from mm_base. Others push onto it with a CAS, without
+   * the lock; the arena takes the whole stack at once with the lock held.
+   */
+  unsigned int remote_;
+#endif
+};
+
+#ifdef MM_THREADS
+#ifndef MM_ARENAS
+#define MM_ARENAS 4
+#endif
+#else
+#define MM_ARENAS 1
+#endif
+
+struct arena mm_arenas[MM_ARENAS];
+
+#ifdef MM_THREADS
+/** the arena the calling thread works on(and holds the lock of) */
+__thread struct arena *mm_arena;
+#else
+#define mm_arena (&mm_arenas[0])
+#endif
+
+#ifdef MM_THREADS
+/**
+ * Thread caches. A thread keeps up to MM_TCACHE_MAX payloads per class:
+ * one class per slab class, then one per fast bin. It takes
+ * MM_TCACHE_BATCH of them from its arena at a time when the class
+ * runs dry, and gives MM_TCACHE_BATCH back at a time when it is full. The
+ * payloads are linked through their first word, as offsets from mm_base.
+ */
+#define MM_TCACHE_BATCH 16
+#define MM_TCACHE_MAX (2 * MM_TCACHE_BATCH)
+#define MM_TCACHE_CLASSES (MM_SLAB_CLASSES + MM_FAST_BINS)
+
+struct tcache {
+  unsigned int head_[MM_TCACHE_CLASSES];  // first payload of each class
+  unsigned int count_[MM_TCACHE_CLASSES]; // number of payloads cached
+  int registered_; // will the cache be flushed when the thread exits?
+};
+
+/** cache of the calling thread */
+__thread struct tcache mm_tcache;
+
+/** its destructor flushes the cache of an exiting thread */
+pthread_key_t mm_tcache_key;
+pthread_once_t mm_tcache_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Chunks. An arena takes its memory from the memlib heap a chunk at a time:
+ *   [chunk_meta | block | block | ... | epilogue ]
+ * The epilogue is the header of an empty used block, so that the last block
+ * of a chunk never coalesces with the next chunk. A chunk starts at a
+ * multiple of MM_GRANULE from mm_base, so no two chunks share a granule;
+ * mm_chunk_map maps each granule to the header of its chunk.
+ */
+#define MM_GRANULE_SHIFT 16
+#define MM_GRANULE (1U << MM_GRANULE_SHIFT)
+
+struct chunk_meta {
+  size_t size_;         // size of the chunk
+  struct arena *arena_; // arena that owns the chunk
+};
+
+/** offset of the header of the chunk of each granule */
+unsigned int mm_chunk_map[HEAP_LIMIT / MM_GRANULE + 1];
+
+/** keeps chunks from interleaving in the memlib heap */
+pthread_mutex_t mm_chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Arena assignment. A thread is given an arena round-robin on its first
+ * call, and moves on to the next one after finding it locked
+ * MM_MIGRATE_AFTER times in a row.
+ */
+#define MM_MIGRATE_AFTER 4
+
+/** arena the calling thread allocates from */
+__thread struct arena *mm_home;
+
+/** times in a row the calling thread found mm_home locked */
+__thread unsigned int mm_contended;
 
-/** head of free list of small blocks(<= 32) */
-void *mm_small;
-/** head of free list of middle sized blocks(32-1024) */
-void *mm_middle;
-/** head of free list of large blocks(>=1024) */
-void *mm_large;
+/** number of threads given an arena so far */
+unsigned int mm_next_arena;
+#endif
+
+/**
+ * Tags in the low bits of a header.
+ * MM_USED: the block is allocated.
+ * MM_PREV_USED: the block on the left is allocated(or there is none), so
+ * the word before this block is not a footer.
+ * MM_MAPPED: the block is a mapping of its own, which starts at the page of
+ * the header; its size is the size of that mapping.
+ * MM_SAMPLED: the same bit on a used block of the heap, which is never
+ * mapped: the block has a record in mm_samples.
+ */
+#define MM_USED 0x1
+#define MM_PREV_USED 0x2
+#define MM_MAPPED 0x4
+#define MM_SAMPLED 0x4
+#define MM_TAGS 0x7
 
 /**
- * Layout of free block: [size | last | pred | succ ]
- * pred(predecessor), succ(successor) are used to look up in the free list;
- * while last, next are its absolute neighbors.
+ * Layout of free block: [size | pred | succ | ... | size ]
+ * pred(predecessor), succ(successor) are used to look up in the free list,
+ * stored as offsets from mm_base(0 for none). The last word is the footer.
  */
 struct free_meta {
-  size_t size_; // size of entire block(including meta)
-  size_t last_; // address of previous block(used or free)
-  size_t pred_; // predecessor in the free list
-  size_t succ_; // successor in the free list
+  size_t size_;       // size of entire block(including meta) and tags
+  unsigned int pred_; // predecessor in the free list
+  unsigned int succ_; // successor in the free list
+};
+/**
+ * Layout of large free block: [size | left | right | ... | size ]
+ * left, right are its children in tree_; the tree is ordered by size
+ * first and then by address, so no two nodes have the same key.
+ */
+struct tree_meta {
+  size_t size_;        // size of entire block(including meta) and tags
+  unsigned int left_;  // left child in the tree
+  unsigned int right_; // right child in the tree
+  unsigned int epoch_; // epoch it was put in the tree, or MM_RELEASED
+};
+/**
+ * Layout of slab: [slab_meta | free bitmap | slot | slot | ... ]
+ * A set bit in the bitmap means the slot is free. A slab is on the list of
+ * its class iff it has free slots; pred, succ are offsets from mm_base.
+ */
+struct slab_meta {
+  unsigned int pred_;    // predecessor in the slab list
+  unsigned int succ_;    // successor in the slab list
+  unsigned short slot_;  // size of a slot
+  unsigned short nslot_; // number of slots
+  unsigned short used_;  // number of slots in use
+  unsigned char first_;  // offset of the first slot
+  unsigned char hint_;   // words of the bitmap before this one are all 0
+  unsigned int map_[];   // free bitmap
+};
+/**
+ * Layout of block in a fast bin: [size | succ | ... ]
+ * It has the tags of a used block; succ is an offset from mm_base.
+ */
+struct fast_meta {
+  size_t size_;       // size and tags
+  unsigned int succ_; // next block in the fast bin
 };
 /**
- * Layout of used block: [size | last ]
- * No reason to store predecessor and successor.
+ * Layout of used block: [size | payload ]
+ * No reason to store predecessor, successor or footer.
  */
 struct used_meta {
-  size_t size_; // size of entire block(including meta)
-  size_t last_; // address of previous block(used or free)
+  size_t size_; // size of entire block(including meta) and tags
+};
+/**
+ * Layout of region chunk: [region_chunk | bytes ... ]
+ * The payload of a block from mm_malloc. The first chunk of a region holds
+ * the mm_region right after its header, and lives as long as the region.
+ */
+struct region_chunk {
+  struct region_chunk *next_; // chunk taken before this one
+};
+struct mm_region {
+  struct region_chunk *chunks_; // every chunk, the newest first
+  char *top_;                   // next free byte of the current chunk
+  char *end_;                   // end of the current chunk
+  size_t chunk_sz_;             // size of a chunk
+};
+/**
+ * Layout of pool slab: [pool_slab | ... | object | object | ... ]
+ * A free object holds the next free object of its pool(or magazine) in its
+ * first word. Objects are carved from the newest slab only when the free
+ * list is empty.
+ */
+struct pool_slab {
+  struct pool_slab *next_; // slab taken before this one
+};
+#ifdef MM_THREADS
+struct magazine {
+  struct mm_pool *pool_;  // pool the objects belong to
+  void *head_;            // first cached object
+  unsigned int count_;    // number of objects cached
+  struct magazine *next_; // next magazine of the pool
+  struct magazine *prev_; // previous magazine of the pool
+};
+#endif
+struct mm_pool {
+  void *free_;              // first free object
+  char *top_;               // next object to carve from the newest slab
+  char *end_;               // end of the newest slab
+  struct pool_slab *slabs_; // every slab, the newest first
+  size_t obj_sz_;           // size of an object
+  size_t align_;            // alignment of the slabs
+  size_t slab_sz_;          // size of a slab
+#ifdef MM_THREADS
+  pthread_mutex_t lock_;  // guards everything above and mags_
+  pthread_key_t key_;     // magazine of the calling thread
+  struct magazine *mags_; // every magazine, to free them with the pool
+#endif
 };
 
 /**
- * @return size of free block meta
+ * @return size of free block meta(header, links and footer), which is also
+ * the minimum size of a block.
  */
-inline size_t free_meta_sz() { return ALIGN(sizeof(struct free_meta)); }
+inline size_t free_meta_sz() {
+  return ALIGN(sizeof(struct free_meta) + sizeof(size_t));
+}
 /**
  * @return size of used block meta
  */
@@ -90,430 +563,2637 @@ inline size_t used_meta_sz() { return ALIGN(sizeof(struct used_meta)); }
 #define MINVOL (16U)
 
 /**
- * @param node: the node in a free list or others.
- * @return the address of next block of node, null if node is end_blk.
+ * @return index of the most significant set bit of a non-zero x.
  */
-inline void *get_next(void *node) {
-  return node == end_blk ? MMEOL
-                         : node + (static_cast(node, size_t *)[0] & (~0x7));
+static inline size_t msb(size_t x) {
+  return sizeof(unsigned long) * 8 - 1 - __builtin_clzl(x);
 }
 
 /**
- * @brief For a given size and the head pointer of a free list,
- * find the **first** block that has a larger volume than size.
- * @param head head of the list to look into.
- * @param size size of block to fit.
- *
- * @return MMEOL is failed to find any.
+ * @param size size of an entire block(including meta)
+ * @return index of the free list that holds blocks of this size.
  */
-void *find_fit(void *head, size_t size);
+static inline size_t size_class(size_t size) {
+  if (size < MM_CLASS_LINEAR) {
+    return size / ALIGNMENT;
+  }
+  size_t fl = msb(size);
+  size_t idx = ((fl - msb(MM_CLASS_LINEAR) + 1) << MM_CLASS_SHIFT) +
+               ((size >> (fl - MM_CLASS_SHIFT)) & ((1 << MM_CLASS_SHIFT) - 1));
+  return idx < MM_NUM_CLASSES ? idx : MM_NUM_CLASSES - 1;
+}
 
 /**
- * @brief take the vacancy of a node and set its successor and size properly.
- * If nessesary, add the remnent to one of the 3 free lists.
- *
- * @param node the pointer to the node to take from
- * @param aligned size needed to allocate
+ * @brief mark bins_[idx] as non-empty in the bitmap.
  */
-void take(void *node, size_t aligned);
+static inline void set_bin(size_t idx) {
+  mm_arena->sl_map_[idx >> MM_CLASS_SHIFT] |=
+      1U << (idx & ((1 << MM_CLASS_SHIFT) - 1));
+  mm_arena->fl_map_ |= 1U << (idx >> MM_CLASS_SHIFT);
+}
 
 /**
- * @brief check the integrity of the heap, including the following rule:
- * 1. mm_small, mm_middle, mm_large holds the correct size of free blocks.
- *
- * @return 0 if no integrity violations.
+ * @brief mark bins_[idx] as empty in the bitmap.
  */
-int mm_check();
+static inline void clear_bin(size_t idx) {
+  mm_arena->sl_map_[idx >> MM_CLASS_SHIFT] &=
+      ~(1U << (idx & ((1 << MM_CLASS_SHIFT) - 1)));
+  if (mm_arena->sl_map_[idx >> MM_CLASS_SHIFT] == 0) {
+    mm_arena->fl_map_ &= ~(1U << (idx >> MM_CLASS_SHIFT));
+  }
+}
 
 /**
- * @brief inline check heap consistency
+ * @return the smallest class no less than idx whose free list is non-empty,
+ * MM_NUM_CLASSES if there is none.
  */
-inline void check() {
-#ifdef DEBUG
-  assert(mm_check() == 0);
-#endif
+static inline size_t find_bin(size_t idx) {
+  if (idx >= MM_NUM_CLASSES) {
+    return MM_NUM_CLASSES;
+  }
+  size_t fl = idx >> MM_CLASS_SHIFT;
+  unsigned int sl_map =
+      mm_arena->sl_map_[fl] & (~0U << (idx & ((1 << MM_CLASS_SHIFT) - 1)));
+  if (sl_map == 0) {
+    // nothing left in this power of two, go to the next non-empty one.
+    unsigned int fl_map =
+        fl + 1 < 32 ? mm_arena->fl_map_ & (~0U << (fl + 1)) : 0;
+    if (fl_map == 0) {
+      return MM_NUM_CLASSES;
+    }
+    fl = __builtin_ctz(fl_map);
+    sl_map = mm_arena->sl_map_[fl];
+  }
+  return (fl << MM_CLASS_SHIFT) + __builtin_ctz(sl_map);
 }
+
 /**
- * @brief inline check end_blk consistency
+ * @return the block at offset off of the heap, MMEOL if off is 0.
  */
-inline void check_end() {
-#ifdef DEBUG
-  assert(end_blk + (static_cast(end_blk, struct free_meta *)->size_ & (~0x7)) ==
-         mem_heap_hi() + 1);
-#endif
+static inline void *blk_at(unsigned int off) {
+  return off == 0 ? MMEOL : mm_base + off;
 }
 
 /**
- * @brief grow the heap size by some bytes. If end_blk is free, merge with
- * end_blk. Otherwise, reset end_blk and will not put it on the free list.
- * @return 0 if succeed.
+ * @return offset of blk in the heap, 0 if blk is MMEOL.
  */
-int grow_heap(size_t bytes);
+static inline unsigned int blk_off(void *blk) {
+  return blk == MMEOL ? 0 : static_cast(blk - mm_base, unsigned int);
+}
 
 /**
- * @brief add a free block to one of the free list.
- *
- * WARNING: you must set its size correctly and clear its used tag before
- * calling this function!
+ * @return size of the block(without tags).
  */
-void add_free_blk(void *);
+static inline size_t blk_size(void *blk) {
+  return static_cast(blk, size_t *)[0] & (~MM_TAGS);
+}
 
 /**
- * @brief remove a node from the free list.
+ * @return size of a used block, read without the lock of its arena. Its
+ * size is stable, but the owner may flip MM_PREV_USED meanwhile.
  */
-void remove_free_blk(void *blk);
+static inline size_t used_size(void *blk) {
+  return __atomic_load_n(static_cast(blk, size_t *), __ATOMIC_RELAXED) &
+         (~MM_TAGS);
+}
 
 /**
- * @brief merge two free block
- * @param left block with lower address
- * @param right block with higher address
- *
- * NOTE: left, right must be neighbors(will be checked in debug mode) and
- * address of left must be lower than right! Don't worry about their size.
- *
- * NOTE: this function will not add merged block(available in left) into free
- * list instead, you should manually do so.
+ * @brief copy the size of a free block to its footer.
  */
-void merge_blk(void *left, void *right);
+static inline void set_footer(void *blk) {
+  size_t size = blk_size(blk);
+  static_cast(blk + size - sizeof(size_t), size_t *)[0] = size;
+}
 
-/*
- * mm_init - initialize the malloc package.
+/**
+ * @return negative, zero or positive if key (size, blk) is less than, equal
+ * to or greater than the key of node in tree_.
  */
-int mm_init(void) {
-#ifdef DEBUG
-  static_assert(sizeof(size_t) == 4 || sizeof(size_t) == 8);
-#endif
-  // initialize first(also last) large block.
-  size_t init_size = 2 * mem_pagesize();
-  mm_large = mem_sbrk(init_size);
-  // assert(mm_large != NULL && mm_large != end_blk);
-  assert(mm_large != NULL);
-  if (mm_large == (void *)-1) {
-    // oops, fail
-    return -1;
+static inline int key_cmp(size_t size, void *blk, void *node) {
+  size_t node_sz = blk_size(node);
+  if (size != node_sz) {
+    return size < node_sz ? -1 : 1;
   }
+  return blk < node ? -1 : (blk > node ? 1 : 0);
+}
 
-  // initialize end_blk(last block in the heap)
-  end_blk = mm_large;
-
-  // initialize the meta of start block.
-  struct free_meta *meta = static_cast(mm_large, struct free_meta *);
-#ifdef DEBUG
-  // unsigned sub can be problematic, must check.
-  assert(init_size > free_meta_sz());
-  // must be aligned.
-  assert(((init_size - free_meta_sz()) & 0x7) == 0);
-  assert((free_meta_sz() & 0x7) == 0);
-  assert((used_meta_sz() & 0x7) == 0);
-#endif
-  meta->size_ = init_size; // size
-  meta->last_ = 0;         // last = null
-  meta->pred_ = 0;         // predecessor = null
-  meta->succ_ = 0;         // successor = null
+/**
+ * @return index of the MM_SLAB_SIZE page of the heap that holds ptr.
+ */
+static inline size_t page_of(void *ptr) {
+  return (static_cast(ptr, size_t) >> MM_SLAB_SHIFT) -
+         (static_cast(mm_base, size_t) >> MM_SLAB_SHIFT);
+}
 
-  check_end();
-#ifdef DEBUG
-  // check heap integrity
-  assert(mm_check() == 0);
+/**
+ * @return non zero if ptr is a slot of some slab.
+ */
+static inline int is_slab(void *ptr) {
+  size_t page = page_of(ptr);
+#ifdef MM_THREADS
+  // other arenas may be marking pages that share the word.
+  unsigned int word =
+      __atomic_load_n(&mm_slab_map[page >> 5], __ATOMIC_RELAXED);
+#else
+  unsigned int word = mm_slab_map[page >> 5];
 #endif
-  return 0;
+  return (word >> (page & 31)) & 1;
 }
 
-/*
- * mm_malloc - Allocate a block by incrementing the brk pointer.
- *     Always allocate a block whose size is a multiple of the alignment.
+/**
+ * @brief mark the page of slab as a slab, or as not a slab if on is 0.
  */
-void *mm_malloc(size_t size) {
-  // actual size to allocate(not including meta)
-  if (size == 0) {
-    return NULL;
+static inline void mark_slab(void *slab, int on) {
+  size_t page = page_of(slab);
+  unsigned int bit = 1U << (page & 31);
+#ifdef MM_THREADS
+  // other arenas may be marking pages that share the word.
+  if (on) {
+    __atomic_fetch_or(&mm_slab_map[page >> 5], bit, __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_and(&mm_slab_map[page >> 5], ~bit, __ATOMIC_RELAXED);
   }
-  const size_t actual =
-      ALIGN(size) >= free_meta_sz() ? ALIGN(size) : free_meta_sz();
-
-  // look up the free list by size
-  void *res;
-  if (size < 32U) {
-    // look up order: small, middle, large.
-    res = find_fit(mm_small, actual);
-    if (res != MMEOL) {
-      // found
-      take(res, actual);
-      check();
-      return res + used_meta_sz();
-    }
-
-    res = find_fit(mm_middle, actual);
-    if (res != MMEOL) {
-      take(res, actual);
-      check();
-      return res + used_meta_sz();
-    }
-
-    res = find_fit(mm_large, actual);
-    if (res != MMEOL) {
-      take(res, actual);
-      check();
-      return res + used_meta_sz();
-    }
-
-    // must allocate by growing the heap
-    int grow = grow_heap(actual + used_meta_sz());
-    if (grow != 0) {
-      return MMEOL;
-    }
-    res = end_blk;
-    take(end_blk, actual);
-    check();
-    return res + used_meta_sz();
+#else
+  if (on) {
+    mm_slab_map[page >> 5] |= bit;
   } else {
-    if (size < 1024U) {
-      res = find_fit(mm_middle, actual);
-      if (res != MMEOL) {
-        take(res, actual);
-        check();
-        return res + used_meta_sz();
-      }
-      res = find_fit(mm_large, actual);
-      if (res != MMEOL) {
-        take(res, actual);
-        check();
-        return res + used_meta_sz();
-      }
-
-      int grow = grow_heap(actual + used_meta_sz());
-      if (grow != 0) {
-        return MMEOL;
-      }
-      res = end_blk;
-      take(end_blk, actual);
-      check();
-      return res + used_meta_sz();
-    } else {
-      res = find_fit(mm_large, actual);
-      if (res != MMEOL) {
-        take(res, actual);
-        check();
-        return res + used_meta_sz();
-      }
-
-      int grow = grow_heap(actual + used_meta_sz());
-      if (grow != 0) {
-        return MMEOL;
-      }
-      res = end_blk;
-      take(end_blk, actual);
-      check();
-      return res + used_meta_sz();
-    }
+    mm_slab_map[page >> 5] &= ~bit;
   }
+#endif
 }
 
-/*
- * mm_free - Freeing a block does nothing.
+/**
+ * @return the slab that holds ptr.
  */
-void mm_free(void *ptr) {
-  if (ptr == NULL || ptr == (void *)(-1)) {
-    return;
-  }
-  void *blk = ptr - used_meta_sz();
-  struct free_meta *meta = static_cast(blk, struct free_meta *);
-#ifdef DEBUG
-  // make sure that you're not freeing a block that is free.
-  // printf("%u %u \n", meta->size_, meta->last_);
-  assert((meta->size_ & 0x7) != 0);
-#endif
-  // mark as free block.
-  meta->size_ = meta->size_ & (~0x7);
-  // meta of front block in the heap.
-  struct free_meta *last_meta = static_cast(meta->last_, struct free_meta *);
-  // meta of next block in the heap.
-  struct free_meta *next_meta =
-      blk == end_blk ? MMEOL
-                     : static_cast(blk + meta->size_, struct free_meta *);
+static inline void *slab_of(void *ptr) {
+  return static_cast(static_cast(ptr, size_t) & ~(size_t)(MM_SLAB_SIZE - 1),
+                     void *);
+}
 
-  // result block(to be added to free list)
-  void *res = blk;
-  if (next_meta != MMEOL && (next_meta->size_ & 0x7) == 0) {
-    // next block is not null and free! you should merge them.
-    remove_free_blk(static_cast(next_meta, void *));
-    merge_blk(blk, static_cast(next_meta, void *));
-  }
+/**
+ * @param node: the node in a free list or others.
+ * @return the address of next block of node, null if node is end_blk_.
+ */
+static inline void *get_next(void *node) {
+  return node == mm_arena->end_blk_ ? MMEOL : node + blk_size(node);
+}
 
-  if (last_meta != MMEOL && (last_meta->size_ & 0x7) == 0) {
-    // last block is not null and free! you should merge them.
-    remove_free_blk(static_cast(last_meta, void *));
-    merge_blk(static_cast(last_meta, void *), blk);
-    res = static_cast(last_meta, void *);
+/**
+ * @param node: a block whose left neighbor is free(no MM_PREV_USED tag).
+ * @return the address of previous block of node, read from its footer.
+ */
+static inline void *get_prev(void *node) {
+  return node - static_cast(node - sizeof(size_t), size_t *)[0];
+}
+
+/**
+ * @brief For a given size and a free list, find a block that is no smaller
+ * than size, as MM_FIT says. At most MM_FIT_PROBES blocks are examined.
+ * @param idx size class of the list to look into.
+ * @param size size of block to fit(including meta).
+ *
+ * @return MMEOL is failed to find any.
+ */
+void *find_fit(size_t idx, size_t size);
+
+/**
+ * @brief find the smallest block in tree_ that is no smaller than size;
+ * among blocks of the same size, the one with the lowest address.
+ *
+ * @return MMEOL is failed to find any.
+ */
+void *tree_fit(size_t size);
+
+/**
+ * @brief insert a free block into tree_.
+ */
+void tree_insert(void *blk);
+
+/**
+ * @brief remove a free block from tree_.
+ */
+void tree_remove(void *blk);
+
+/**
+ * @brief take the vacancy of a node and set its successor and size properly.
+ * If nessesary, add the remnent to the free list of its class.
+ *
+ * @param node the pointer to the node to take from
+ * @param bytes size of block needed to allocate(including meta)
+ */
+void take(void *node, size_t bytes);
+
+/**
+ * @brief look up the free lists and tree_ for a block of bytes bytes.
+ *
+ * @return MMEOL is failed to find any.
+ */
+void *find_free(size_t bytes);
+
+/**
+ * @brief allocate a used block of bytes bytes whose payload is aligned to
+ * align(a power of two no less than ALIGNMENT). The bytes skipped to reach
+ * the alignment are left as a free block.
+ *
+ * @return the used block, MMEOL if out of memory.
+ */
+void *alloc_aligned(size_t align, size_t bytes);
+
+/**
+ * @brief allocate a slot from the slabs for a request of size bytes.
+ * @return the slot, MMEOL if out of memory.
+ */
+void *slab_alloc(size_t size);
+
+/**
+ * @brief give a slot back to its slab. A slab that becomes empty is freed,
+ * unless it is the only slab of its class that has free slots.
+ */
+void slab_free(void *ptr);
+
+/**
+ * @brief free a used block: coalesce it with its free neighbors, and add
+ * the result to the free lists.
+ */
+void free_blk(void *blk);
+
+/**
+ * @brief give back the pages of every free block of MM_RELEASE_MIN bytes
+ * and up in the subtree at node that has been idle since the epoch before
+ * last, with madvise.
+ */
+void release_free(void *node);
+
+/**
+ * @brief free every block in the fast bins.
+ */
+void consolidate();
+
+/**
+ * @return whether ptr is the payload of a mapped block, i.e. lies outside
+ * the memlib heap.
+ */
+static inline int is_mapped(void *ptr) {
+  return static_cast(ptr - mem_heap_lo(), size_t) >= HEAP_LIMIT;
+}
+
+/**
+ * @return the number of bytes the payload ptr can hold.
+ */
+static inline size_t usable_size(void *ptr) {
+  if (!is_mapped(ptr) && is_slab(ptr)) {
+    return static_cast(slab_of(ptr), struct slab_meta *)->slot_;
+  }
+  return used_size(ptr - used_meta_sz()) - used_meta_sz();
+}
+
+/**
+ * @brief map a block for a request of size bytes, with its payload aligned
+ * to align(a power of two no less than ALIGNMENT).
+ * @return its payload, or MMEOL if out of memory.
+ */
+void *map_alloc(size_t align, size_t size);
+
+/**
+ * @brief unmap the block of ptr.
+ */
+void map_free(void *ptr);
+
+/**
+ * @brief resize a mapped block with mremap, or move it to the heap if size
+ * is below MM_MMAP_THRESHOLD. A block of the heap passed in moves to a
+ * mapping of its own.
+ */
+void *map_realloc(void *ptr, size_t size);
+
+#ifdef MM_PROFILE
+/**
+ * @return the slot of mm_samples where the search for off starts.
+ */
+static inline size_t sample_slot(unsigned int off) {
+  return static_cast((off >> 3) * 2654435761U, unsigned int) >>
+         (32 - MM_PROFILE_SHIFT);
+}
+
+/**
+ * @brief maybe record site as the caller that allocated ptr(of size bytes).
+ */
+void profile_alloc(void *ptr, size_t size, void *site);
+
+/**
+ * @brief drop the record of ptr, which is about to be freed, if it has one.
+ * @param locked whether the caller holds the lock of the arena that owns
+ * ptr(under MM_THREADS).
+ */
+void profile_free(void *ptr, int locked);
+#define PROFILE_ALLOC(ptr, size)                                               \
+  profile_alloc(ptr, size, __builtin_return_address(0))
+#define PROFILE_FREE(ptr) profile_free(ptr, 0)
+#define PROFILE_FREE_LOCKED(ptr) profile_free(ptr, 1)
+#else
+#define PROFILE_ALLOC(ptr, size) ((void)0)
+#define PROFILE_FREE(ptr) ((void)0)
+#define PROFILE_FREE_LOCKED(ptr) ((void)0)
+#endif
+
+#ifdef MM_THREADS
+/**
+ * @brief take a payload for a request of size bytes from the cache of the
+ * calling thread, refilling the cache from an arena if needed.
+ * @return MMEOL if size is not cached, or out of memory.
+ */
+void *tcache_get(size_t size);
+
+/**
+ * @brief put a payload into the cache of the calling thread, flushing the
+ * cache to the arenas if it is full.
+ * @return 0 if ptr is cached.
+ */
+int tcache_put(void *ptr);
+
+/**
+ * @return the arena that owns the chunk of ptr.
+ */
+static inline struct arena *arena_of(void *ptr) {
+  unsigned int off = mm_chunk_map[static_cast(ptr - mm_base, size_t) >>
+                                  MM_GRANULE_SHIFT];
+  return static_cast(mm_base + off, struct chunk_meta *)->arena_;
+}
+
+/**
+ * @brief give ptr back to ar without taking its lock.
+ */
+static inline void remote_push(struct arena *ar, void *ptr) {
+  unsigned int head = __atomic_load_n(&ar->remote_, __ATOMIC_RELAXED);
+  do {
+    static_cast(ptr, unsigned int *)[0] = head;
+  } while (!__atomic_compare_exchange_n(&ar->remote_, &head, blk_off(ptr), 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief free everything others pushed onto the remote stack of mm_arena.
+ */
+void remote_drain();
+
+/**
+ * @brief lock ar and make it the arena of the calling thread.
+ */
+static inline void arena_enter(struct arena *ar) {
+  pthread_mutex_lock(&ar->lock_);
+  mm_arena = ar;
+}
+
+/**
+ * @brief unlock the arena of the calling thread.
+ */
+static inline void arena_leave() { pthread_mutex_unlock(&mm_arena->lock_); }
+
+/**
+ * @brief lock the arena the calling thread allocates from, giving the thread
+ * an arena first if it has none, or another one if it keeps waiting for it.
+ */
+static inline void arena_pick() {
+  struct arena *ar = mm_home;
+  if (ar == NULL) {
+    unsigned int idx = __atomic_fetch_add(&mm_next_arena, 1, __ATOMIC_RELAXED);
+    ar = &mm_arenas[idx % MM_ARENAS];
+  }
+  if (pthread_mutex_trylock(&ar->lock_) == 0) {
+    mm_contended = 0;
+  } else {
+    if (++mm_contended >= MM_MIGRATE_AFTER) {
+      ar = &mm_arenas[(ar - mm_arenas + 1) % MM_ARENAS];
+      mm_contended = 0;
+    }
+    pthread_mutex_lock(&ar->lock_);
+  }
+  mm_home = ar;
+  mm_arena = ar;
+}
+#endif
+
+/**
+ * @brief cut a used block down to bytes, and free the rest if it is large
+ * enough to be worth a block of its own.
+ *
+ * @param blk the used block to shrink
+ * @param bytes size of block to keep(including meta)
+ */
+void shrink_blk(void *blk, size_t bytes);
+
+/**
+ * @brief check the integrity of the heap, including the following rule:
+ * 1. every list in bins_ holds free blocks of its own size class.
+ * 2. tree_ is ordered and holds large free blocks only.
+ * 3. every free block has a footer, and its right neighbor knows that the
+ * block is free.
+ * 4. every list in slabs_ holds slabs of its own class with free slots.
+ * 5. every fast bin holds used blocks of its own size, and fast_bytes_
+ * counts them.
+ * 6. walking the blocks in address order, the tags of each block agree with
+ * its left neighbor, no two free blocks are adjacent, the last block is
+ * end_blk_, and the free lists hold every free block found. With
+ * MM_THREADS, every chunk of the arena is walked, and the epilogue of each
+ * older chunk knows whether its last block is in use.
+ *
+ * @return 0 if no integrity violations.
+ */
+int mm_check();
+
+/**
+ * @brief rule 6 of mm_check.
+ */
+int check_blocks(size_t ntree);
+
+/**
+ * @brief inline check heap consistency, once in MM_CHECK_PERIOD calls.
+ */
+static inline void check() {
+#ifdef DEBUG
+  if (++mm_arena->checks_ >= MM_CHECK_PERIOD) {
+    mm_arena->checks_ = 0;
+    assert(mm_check() == 0);
+  }
+#endif
+}
+
+/**
+ * @brief check what a block that was just touched shares with its
+ * neighbors: the tags, the footers, and that it is coalesced if free.
+ */
+static inline void check_blk(void *blk) {
+#ifdef DEBUG
+  size_t word = static_cast(blk, size_t *)[0];
+  assert(blk_size(blk) >= free_meta_sz());
+  void *next = get_next(blk);
+  if (next != MMEOL) {
+    // the right neighbor knows whether blk is free.
+    assert(((static_cast(next, size_t *)[0] & MM_PREV_USED) != 0) ==
+           ((word & MM_USED) != 0));
+  }
+  if ((word & MM_USED) == 0) {
+    assert(static_cast(blk + blk_size(blk), size_t *)[-1] == blk_size(blk));
+    assert((word & MM_PREV_USED) != 0);
+    assert(next == MMEOL || (static_cast(next, size_t *)[0] & MM_USED) != 0);
+  } else if ((word & MM_PREV_USED) == 0) {
+    // the left neighbor is free, and its footer leads here.
+    void *prev = get_prev(blk);
+    assert((static_cast(prev, size_t *)[0] & MM_USED) == 0);
+    assert(prev + blk_size(prev) == blk);
+  }
+#else
+  (void)blk;
+#endif
+}
+/**
+ * @return the end of the last block of the arena.
+ */
+static inline void *heap_top() {
+#ifdef MM_THREADS
+  return mm_arena->top_;
+#else
+  return mem_heap_hi() + 1;
+#endif
+}
+
+/**
+ * @brief inline check end_blk_ consistency
+ */
+static inline void check_end() {
+#ifdef DEBUG
+  assert(mm_arena->end_blk_ + blk_size(mm_arena->end_blk_) == heap_top());
+#endif
+}
+
+/**
+ * @brief grow the heap so that end_blk_ is a free block of exactly bytes
+ * bytes. If end_blk_ is free, merge with end_blk_. Otherwise, append a new
+ * block and make it end_blk_. Either way end_blk_ ends up on the free list.
+ * Nothing happens if end_blk_ is free and already that large.
+ *
+ * NOTE: with MM_THREADS, the newest chunk of the arena only grows if it is
+ * still on top of the memlib heap. Otherwise a new chunk is taken instead,
+ * and end_blk_ becomes its only block, of at least bytes bytes.
+ * @return 0 if succeed.
+ */
+int grow_heap(size_t bytes);
+
+/**
+ * @return the least number of bytes the heap grows by.
+ */
+static inline size_t grow_step() {
+#ifdef MM_THREADS
+  // other arenas move the break under mm_chunk_lock.
+  pthread_mutex_lock(&mm_chunk_lock);
+  size_t heap = mem_heapsize();
+  pthread_mutex_unlock(&mm_chunk_lock);
+#else
+  size_t heap = mem_heapsize();
+#endif
+  size_t step = ALIGN(heap >> MM_GROW_SHIFT);
+  return step < free_meta_sz() ? free_meta_sz() : step;
+}
+
+/**
+ * @return how large end_blk_ should grow to hold a block of bytes bytes.
+ */
+static inline size_t grow_target(size_t bytes) {
+  void *end = mm_arena->end_blk_;
+  size_t have = end != MMEOL && (static_cast(end, size_t *)[0] & MM_USED) == 0
+                    ? blk_size(end)
+                    : 0;
+  size_t step = grow_step();
+  return have >= bytes || bytes - have >= step ? bytes : have + step;
+}
+
+/**
+ * @brief note that the bytes below hi may have been written.
+ */
+static inline void mark_dirty(void *hi) {
+  if (mm_arena->zero_ < hi) {
+    mm_arena->zero_ = hi;
+  }
+}
+
+/**
+ * @brief note that end_blk_ has just been made a free block, zero from fresh
+ * on but for its header and links.
+ */
+static inline void set_zero(void *fresh) {
+  void *lo = mm_arena->end_blk_ + sizeof(struct free_meta);
+  mm_arena->zero_ = fresh > lo ? fresh : lo;
+}
+
+/**
+ * @brief give the tail of end_blk_ back to memlib if it is free and much
+ * larger than a growth step.
+ */
+void trim_heap();
+
+/**
+ * @brief add a free block to the free list of its size class, or to tree_
+ * if it is large.
+ *
+ * WARNING: you must set its size correctly and clear its used tag before
+ * calling this function!
+ */
+void add_free_blk(void *);
+
+/**
+ * @brief remove a node from the free list or tree_.
+ */
+void remove_free_blk(void *blk);
+
+/**
+ * @brief merge two free block
+ * @param left block with lower address
+ * @param right block with higher address
+ *
+ * NOTE: left, right must be neighbors(will be checked in debug mode) and
+ * address of left must be lower than right! Don't worry about their size.
+ *
+ * NOTE: this function will not add merged block(available in left) into free
+ * list instead, you should manually do so.
+ */
+void merge_blk(void *left, void *right);
+
+/*
+ * mm_init - initialize the malloc package.
+ */
+int mm_init(void) {
+#ifdef DEBUG
+  static_assert(sizeof(size_t) == 4 || sizeof(size_t) == 8);
+  // mm_classes.h must agree with size_class.
+  static_assert(sizeof(mm_class_min) ==
+                MM_NUM_CLASSES * sizeof(mm_class_min[0]));
+  for (size_t i = 0; i < MM_NUM_CLASSES; ++i) {
+    assert(size_class(mm_class_min[i]) == i);
+  }
+#endif
+  // the heap may have been reset; forget every free block.
+  memset(mm_arenas, 0, sizeof(mm_arenas));
+  memset(mm_slab_map, 0, sizeof(mm_slab_map));
+#ifdef MM_STATS
+  memset(&mm_stat, 0, sizeof(mm_stat));
+#endif
+#ifdef MM_PROFILE
+  memset(mm_samples, 0, sizeof(mm_samples));
+  mm_nsamples = 0;
+  mm_sample_tick = 0;
+#endif
+#ifdef MM_THREADS
+  // NOTE: caches of other threads are not reset, so no thread but the
+  // caller may be using the allocator here.
+  memset(mm_tcache.head_, 0, sizeof(mm_tcache.head_));
+  memset(mm_tcache.count_, 0, sizeof(mm_tcache.count_));
+  for (size_t i = 0; i < MM_ARENAS; ++i) {
+    pthread_mutex_init(&mm_arenas[i].lock_, NULL);
+  }
+  mm_home = NULL;
+  mm_next_arena = 0;
+  mm_arena = &mm_arenas[0];
+
+  // arenas take their chunks when they first need them; the first one
+  // starts right away, like the heap of a single arena would.
+  mm_base = mem_sbrk(0);
+  if (grow_heap(2 * mem_pagesize()) != 0) {
+    return -1;
+  }
+  check();
+  return 0;
+#else
+
+  // initialize first(also last) block.
+  size_t init_size = 2 * mem_pagesize();
+  void *zero = mem_zero_lo();
+  mm_base = mem_sbrk(init_size);
+  assert(mm_base != NULL);
+  if (mm_base == (void *)-1) {
+    // oops, fail
+    return -1;
+  }
+
+  // the first word is a prologue, so that no block is at offset 0.
+  static_cast(mm_base, size_t *)[0] = ALIGNMENT | MM_USED | MM_PREV_USED;
+
+  // initialize end_blk_(last block in the heap)
+  mm_arena->end_blk_ = mm_base + ALIGNMENT;
+
+  // initialize the meta of start block.
+  struct free_meta *meta = static_cast(mm_arena->end_blk_, struct free_meta *);
+#ifdef DEBUG
+  // unsigned sub can be problematic, must check.
+  assert(init_size > free_meta_sz() + ALIGNMENT);
+  // must be aligned.
+  assert((free_meta_sz() & 0x7) == 0);
+  assert((used_meta_sz() & 0x7) == 0);
+#endif
+  meta->size_ = (init_size - ALIGNMENT) | MM_PREV_USED;
+  set_footer(mm_arena->end_blk_);
+  add_free_blk(mm_arena->end_blk_);
+  set_zero(zero > mm_base ? zero : mm_base);
+
+  check_end();
+#ifdef DEBUG
+  // check heap integrity
+  assert(mm_check() == 0);
+#endif
+  return 0;
+#endif
+}
+
+/**
+ * @return size of block(including meta) needed to hold size bytes.
+ */
+static inline size_t blk_need(size_t size) {
+  return ALIGN(size + used_meta_sz()) >= free_meta_sz()
+             ? ALIGN(size + used_meta_sz())
+             : free_meta_sz();
+}
+
+#ifdef MM_STATS
+/**
+ * @return the class the block whose payload is ptr is counted in. Blocks
+ * are counted by the size they have, not the size asked for, so that a
+ * block is freed from the class it was allocated in.
+ */
+static inline size_t stat_class(void *ptr) {
+  if (is_mapped(ptr)) {
+    return MM_NUM_CLASSES + 1;
+  }
+  size_t actual = blk_need(usable_size(ptr));
+  return actual < MM_TREE_MIN ? size_class(actual) : MM_NUM_CLASSES;
+}
+#endif
+
+/**
+ * @return a free block of at least actual bytes from mm_arena, growing the
+ * heap if none fits; MMEOL if out of memory.
+ */
+static void *heap_fit(size_t actual) {
+  if (actual >= MM_TREE_MIN && mm_arena->fast_bytes_ != 0) {
+    consolidate();
+  }
+  void *res = find_free(actual);
+  if (res == MMEOL && mm_arena->fast_bytes_ != 0) {
+    // try again with the cached blocks coalesced before growing the heap.
+    consolidate();
+    res = find_free(actual);
+  }
+  if (res == MMEOL && grow_heap(grow_target(actual)) == 0) {
+    res = mm_arena->end_blk_;
+  }
+  return res;
+}
+
+/*
+ * heap_malloc - Allocate a block from mm_arena, by incrementing the
+ *     brk pointer if needed. Always allocate a block whose size is a
+ *     multiple of the alignment. Caller must hold the lock of mm_arena.
+ */
+static void *heap_malloc(size_t size) {
+  if (size == 0) {
+    return NULL;
+  }
+  void *res;
+  if (size < MM_SLAB_MAX) {
+    res = slab_alloc(size);
+    check();
+    return res;
+  }
+  // actual size to allocate(including meta)
+  const size_t actual = blk_need(size);
+
+  if (actual <= MM_FAST_MAX && mm_arena->fast_[actual / ALIGNMENT] != MMEOL) {
+    // reuse a block of exactly this size as is.
+    res = mm_arena->fast_[actual / ALIGNMENT];
+    mm_arena->fast_[actual / ALIGNMENT] =
+        blk_at(static_cast(res, struct fast_meta *)->succ_);
+    mm_arena->fast_bytes_ -= actual;
+    check();
+    return res + used_meta_sz();
+  }
+
+  res = heap_fit(actual);
+  if (res == MMEOL) {
+    return MMEOL;
+  }
+  take(res, actual);
+  check();
+  return res + used_meta_sz();
+}
+
+/*
+ * heap_calloc - Allocate a zeroed block from mm_arena, clearing only the
+ *     bytes not known to be zero. Caller must hold the lock of mm_arena.
+ */
+static void *heap_calloc(size_t size) {
+  const size_t actual = blk_need(size);
+  void *blk = heap_fit(actual);
+  if (blk == MMEOL) {
+    return MMEOL;
+  }
+  void *zero =
+      blk == mm_arena->end_blk_ ? mm_arena->zero_ : blk + blk_size(blk);
+  take(blk, actual);
+  void *payload = blk + used_meta_sz();
+  void *end = blk + blk_size(blk);
+#ifdef DEBUG
+  assert(zero >= payload);
+#endif
+  if (zero < end) {
+    memset(payload, 0, zero - payload);
+    // the last word may have been the footer of end_blk_.
+    static_cast(end, size_t *)[-1] = 0;
+  } else {
+    memset(payload, 0, end - payload);
+  }
+  check();
+  return payload;
+}
+
+/*
+ * heap_malloc_batch - Allocate n blocks of size bytes from mm_arena. The
+ *     blocks are carved side by side out of a single free block. Caller
+ *     must hold the lock of mm_arena.
+ */
+static int heap_malloc_batch(size_t size, size_t n, void **out) {
+  if (size < MM_SLAB_MAX) {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = slab_alloc(size);
+      if (out[i] == MMEOL) {
+        while (i != 0) {
+          slab_free(out[--i]);
+        }
+        return -1;
+      }
+    }
+    check();
+    return 0;
+  }
+  const size_t actual = blk_need(size);
+  if (n > HEAP_LIMIT / actual) {
+    return -1;
+  }
+  void *blk = heap_fit(actual * n);
+  if (blk == MMEOL) {
+    return -1;
+  }
+  take(blk, actual * n);
+  // cut it up; the last block keeps whatever take left over.
+  const size_t last = blk_size(blk) - (n - 1) * actual;
+  const int is_end = blk == mm_arena->end_blk_;
+  static_cast(blk, size_t *)[0] =
+      (n == 1 ? last : actual) | (static_cast(blk, size_t *)[0] & MM_TAGS);
+  out[0] = blk + used_meta_sz();
+  for (size_t i = 1; i < n; ++i) {
+    blk += actual;
+    static_cast(blk, size_t *)[0] =
+        (i + 1 == n ? last : actual) | MM_USED | MM_PREV_USED;
+    out[i] = blk + used_meta_sz();
+  }
+  if (is_end) {
+    mm_arena->end_blk_ = blk;
+  }
+  check();
+  return 0;
+}
+
+/*
+ * heap_free - Cache small blocks in fast bins, free the others for real.
+ *     Caller must hold the lock of mm_arena.
+ */
+static void heap_free(void *ptr) {
+  if (ptr == NULL || ptr == (void *)(-1)) {
+    return;
+  }
+  if (is_slab(ptr)) {
+    slab_free(ptr);
+    check();
+    return;
+  }
+  void *blk = ptr - used_meta_sz();
+  size_t size = blk_size(blk);
+  if (size <= MM_FAST_MAX) {
+#ifdef DEBUG
+    assert((static_cast(blk, size_t *)[0] & MM_USED) != 0);
+#endif
+    // cache it; it stays used to the eyes of its neighbors.
+    static_cast(blk, struct fast_meta *)->succ_ =
+        blk_off(mm_arena->fast_[size / ALIGNMENT]);
+    mm_arena->fast_[size / ALIGNMENT] = blk;
+    mm_arena->fast_bytes_ += size;
+    if (mm_arena->fast_bytes_ > MM_FAST_BUDGET) {
+      consolidate();
+    }
+    check();
+    return;
+  }
+  free_blk(blk);
+  check();
+}
+
+/*
+ * heap_realloc - Resize the block in place when possible: shrink by
+ *     splitting off the tail, grow into a free right neighbor, or grow the
+ *     heap when the block(or its free right neighbor) is end_blk_. Only when
+ *     none of these works, fall back to heap_malloc, memcpy and heap_free.
+ *     Caller must hold the lock of mm_arena.
+ */
+static void *heap_realloc(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return heap_malloc(size);
+  }
+  if (size == 0) {
+    heap_free(ptr);
+    return NULL;
+  }
+  if (is_slab(ptr)) {
+    // a slot can't grow; keep it as long as the request still fits.
+    size_t slot = static_cast(slab_of(ptr), struct slab_meta *)->slot_;
+    if (size <= slot) {
+      return ptr;
+    }
+    void *newptr = heap_malloc(size);
+    if (newptr == NULL) {
+      return NULL;
+    }
+    memcpy(newptr, ptr, slot);
+    slab_free(ptr);
+    check();
+    return newptr;
+  }
+  void *blk = ptr - used_meta_sz();
+  struct used_meta *meta = static_cast(blk, struct used_meta *);
+  const size_t actual = blk_need(size);
+  const size_t old = blk_size(blk);
+
+  if (actual <= old) {
+    // shrink: give the tail back.
+    shrink_blk(blk, actual);
+    check();
+    return ptr;
+  }
+
+  void *next = get_next(blk);
+  int next_free =
+      next != MMEOL && (static_cast(next, size_t *)[0] & MM_USED) == 0;
+  size_t avail = old + (next_free ? blk_size(next) : 0);
+  if (avail < actual && (blk == mm_arena->end_blk_ ||
+                         (next_free && next == mm_arena->end_blk_))) {
+    // at the end of the heap: make end_blk_ a free block that is large enough.
+    size_t more = actual - old;
+    if (more < grow_step()) {
+      more = grow_step();
+    }
+    // NOTE: with MM_THREADS, the heap may have grown by a new chunk instead.
+    if (grow_heap(more) == 0 && get_next(blk) == mm_arena->end_blk_) {
+      next = mm_arena->end_blk_;
+      next_free = 1;
+      avail = old + more;
+    }
+  }
+
+  if (next_free && avail >= actual) {
+    // grow into the free right neighbor.
+    remove_free_blk(next);
+    if (next == mm_arena->end_blk_) {
+      mm_arena->end_blk_ = blk;
+    }
+    meta->size_ = avail | (meta->size_ & MM_TAGS);
+    next = get_next(blk);
+    if (next != MMEOL) {
+      static_cast(next, size_t *)[0] |= MM_PREV_USED;
+    }
+    shrink_blk(blk, actual);
+    // it may have eaten into the zero bytes of end_blk_.
+    mark_dirty(blk + blk_size(blk) + sizeof(struct free_meta));
+    check_blk(blk);
+    check();
+    return ptr;
+  }
+
+  void *oldptr = ptr;
+  void *newptr;
+  size_t copySize;
+
+  newptr = heap_malloc(size);
+  if (newptr == NULL)
+    return NULL;
+  copySize = blk_size(oldptr - used_meta_sz()) - used_meta_sz();
+  if (size < copySize)
+    copySize = size;
+  memcpy(newptr, oldptr, copySize);
+  heap_free(oldptr);
+  return newptr;
+}
+
+/**
+ * @brief mm_malloc, without counting or sampling the request.
+ */
+static void *route_malloc(size_t size) {
+  if (size >= MM_MMAP_THRESHOLD) {
+    return map_alloc(ALIGNMENT, size);
+  }
+#ifdef MM_THREADS
+  void *res = tcache_get(size);
+  if (res == MMEOL) {
+    arena_pick();
+    remote_drain();
+    res = heap_malloc(size);
+    arena_leave();
+  }
+  return res;
+#else
+  return heap_malloc(size);
+#endif
+}
+
+/*
+ * mm_malloc - Allocate a block whose size is a multiple of the alignment.
+ */
+void *mm_malloc(size_t size) {
+  void *res = route_malloc(size);
+  MM_STAT_BLK(malloc_, res);
+  PROFILE_ALLOC(res, size);
+  return res;
+}
+
+/*
+ * mm_free - Free a block.
+ */
+void mm_free(void *ptr) {
+  if (ptr == NULL || ptr == (void *)(-1)) {
+    return;
+  }
+  MM_STAT(free_[stat_class(ptr)], 1);
+  if (is_mapped(ptr)) {
+    map_free(ptr);
+    return;
+  }
+  PROFILE_FREE(ptr);
+#ifdef MM_THREADS
+  struct arena *owner = arena_of(ptr);
+  if (owner != mm_home) {
+    // not ours: hand it over without waiting for the lock of the owner.
+    remote_push(owner, ptr);
+    return;
+  }
+  if (tcache_put(ptr) == 0) {
+    return;
+  }
+  arena_enter(owner);
+  heap_free(ptr);
+  arena_leave();
+#else
+  heap_free(ptr);
+#endif
+}
+
+/*
+ * mm_realloc - Resize a block, in place when possible.
+ */
+void *mm_realloc(void *ptr, size_t size) {
+  void *res;
+  if (ptr != NULL && (is_mapped(ptr) || size >= MM_MMAP_THRESHOLD)) {
+    res = map_realloc(ptr, size);
+  } else if (ptr == NULL) {
+    res = route_malloc(size);
+  } else {
+    PROFILE_FREE(ptr);
+#ifdef MM_THREADS
+    // resize within the arena that owns the block.
+    arena_enter(arena_of(ptr));
+    res = heap_realloc(ptr, size);
+    arena_leave();
+#else
+    res = heap_realloc(ptr, size);
+#endif
+  }
+  MM_STAT_BLK(realloc_, res);
+  PROFILE_ALLOC(res, size);
+  return res;
+}
+
+/*
+ * mm_calloc - Allocate a zeroed array of n elements of size bytes each.
+ */
+void *mm_calloc(size_t n, size_t size) {
+  if (size != 0 && n > (size_t)-1 / size) {
+    // n * size overflows.
+    return NULL;
+  }
+  size_t bytes = n * size;
+  void *res;
+  if (bytes < MM_SLAB_MAX || blk_need(bytes) <= MM_FAST_MAX) {
+    // small ones are likely to be recycled anyway.
+    res = route_malloc(bytes);
+    if (res != NULL) {
+      memset(res, 0, bytes);
+    }
+  } else if (bytes >= MM_MMAP_THRESHOLD) {
+    // fresh mappings are zero.
+    res = map_alloc(ALIGNMENT, bytes);
+  } else {
+#ifdef MM_THREADS
+    arena_pick();
+    remote_drain();
+#endif
+    res = heap_calloc(bytes);
+#ifdef MM_THREADS
+    arena_leave();
+#endif
+  }
+  MM_STAT_BLK(malloc_, res);
+  PROFILE_ALLOC(res, bytes);
+  return res;
+}
+
+/*
+ * mm_malloc_batch - Allocate n blocks of size bytes each into out, in one
+ *     go. Either all of them are allocated, or none.
+ */
+int mm_malloc_batch(size_t size, size_t n, void **out) {
+  if (n == 0) {
+    return 0;
+  }
+  if (size == 0) {
+    return -1;
+  }
+  if (size >= MM_MMAP_THRESHOLD) {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = map_alloc(ALIGNMENT, size);
+      if (out[i] == MMEOL) {
+        while (i != 0) {
+          map_free(out[--i]);
+        }
+        return -1;
+      }
+      MM_STAT_BLK(malloc_, out[i]);
+    }
+    return 0;
+  }
+#ifdef MM_THREADS
+  arena_pick();
+  remote_drain();
+#endif
+  int res = heap_malloc_batch(size, n, out);
+#ifdef MM_THREADS
+  arena_leave();
+#endif
+#ifdef MM_STATS
+  for (size_t i = 0; res == 0 && i < n; ++i) {
+    MM_STAT_BLK(malloc_, out[i]);
+  }
+#endif
+  return res;
+}
+
+static int ptr_cmp(const void *lhs, const void *rhs) {
+  void *a = *static_cast(lhs, void *const *);
+  void *b = *static_cast(rhs, void *const *);
+  return a < b ? -1 : a > b;
+}
+
+/*
+ * mm_free_batch - Free n blocks at once. ptrs is sorted by address in
+ *     place, so that blocks next to each other are coalesced into one run
+ *     before the run is freed. Small blocks skip the caches.
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+  for (size_t i = 1; i < n; ++i) {
+    if (ptrs[i - 1] > ptrs[i]) {
+      qsort(ptrs, n, sizeof(void *), ptr_cmp);
+      break;
+    }
+  }
+#ifdef MM_THREADS
+  struct arena *held = NULL;
+#endif
+  // blocks to free, merged into one used block so far.
+  void *run = MMEOL;
+  for (size_t i = 0; i < n; ++i) {
+    void *ptr = ptrs[i];
+    if (ptr == NULL || ptr == (void *)(-1)) {
+      continue;
+    }
+    MM_STAT(free_[stat_class(ptr)], 1);
+    if (is_mapped(ptr)) {
+      map_free(ptr);
+      continue;
+    }
+#ifdef MM_THREADS
+    struct arena *owner = arena_of(ptr);
+    if (owner != held) {
+      if (run != MMEOL) {
+        free_blk(run);
+        run = MMEOL;
+      }
+      if (held != NULL) {
+        arena_leave();
+      }
+      arena_enter(owner);
+      held = owner;
+    }
+#endif
+    PROFILE_FREE_LOCKED(ptr);
+    if (is_slab(ptr)) {
+      slab_free(ptr);
+      continue;
+    }
+    void *blk = ptr - used_meta_sz();
+    if (run != MMEOL && run + blk_size(run) == blk) {
+      static_cast(run, size_t *)[0] += blk_size(blk);
+      if (blk == mm_arena->end_blk_) {
+        mm_arena->end_blk_ = run;
+      }
+      continue;
+    }
+    if (run != MMEOL) {
+      free_blk(run);
+    }
+    run = blk;
+  }
+  if (run != MMEOL) {
+    free_blk(run);
+  }
+#ifdef MM_THREADS
+  if (held != NULL) {
+    check();
+    arena_leave();
+  }
+#else
+  check();
+#endif
+}
+
+/*
+ * mm_memalign - Allocate a block whose payload is aligned to align, which
+ *     must be a power of two. The bytes skipped to reach the alignment are
+ *     left free.
+ */
+void *mm_memalign(size_t align, size_t size) {
+  if (align == 0 || (align & (align - 1)) != 0) {
+    return NULL;
+  }
+  if (size == 0) {
+    return NULL;
+  }
+  void *res;
+  if (align <= ALIGNMENT) {
+    res = route_malloc(size);
+  } else if (size >= MM_MMAP_THRESHOLD) {
+    res = map_alloc(align, size);
+  } else {
+#ifdef MM_THREADS
+    arena_pick();
+    remote_drain();
+#endif
+    void *blk = alloc_aligned(align, blk_need(size));
+    check();
+#ifdef MM_THREADS
+    arena_leave();
+#endif
+    res = blk == MMEOL ? NULL : blk + used_meta_sz();
+  }
+  MM_STAT_BLK(malloc_, res);
+  PROFILE_ALLOC(res, size);
+  return res;
+}
+
+/*
+ * mm_aligned_alloc - Same as mm_memalign.
+ */
+void *mm_aligned_alloc(size_t align, size_t size) {
+  return mm_memalign(align, size);
+}
+
+/**
+ * @return size of the header of a region chunk.
+ */
+static inline size_t region_chunk_sz(void) {
+  return ALIGN(sizeof(struct region_chunk));
+}
+
+/**
+ * @return size of the headers of the first chunk of a region.
+ */
+static inline size_t region_first_sz(void) {
+  return region_chunk_sz() + ALIGN(sizeof(struct mm_region));
+}
+
+/**
+ * @return the first chunk of region, which holds it.
+ */
+static inline struct region_chunk *region_first(struct mm_region *region) {
+  return static_cast((void *)region - region_chunk_sz(),
+                     struct region_chunk *);
+}
+
+/**
+ * @brief make the rest of the first chunk of region the current chunk.
+ */
+static inline void region_rewind(struct mm_region *region) {
+  region->top_ = (char *)region_first(region) + region_first_sz();
+  region->end_ = (char *)region_first(region) + region->chunk_sz_;
+}
+
+/*
+ * mm_region_create - Create a region that takes chunks of chunk bytes(0
+ *     for MM_REGION_CHUNK) from mm_malloc. A region is not thread safe.
+ */
+struct mm_region *mm_region_create(size_t chunk) {
+  size_t least = region_first_sz() + MM_REGION_SOLO * ALIGNMENT;
+  chunk = chunk == 0 ? MM_REGION_CHUNK : ALIGN(chunk);
+  if (chunk < least) {
+    chunk = least;
+  }
+  struct region_chunk *first = mm_malloc(chunk);
+  if (first == MMEOL) {
+    return NULL;
+  }
+  first->next_ = MMEOL;
+  struct mm_region *region =
+      static_cast((void *)first + region_chunk_sz(), struct mm_region *);
+  region->chunks_ = first;
+  region->chunk_sz_ = chunk;
+  region_rewind(region);
+  return region;
+}
+
+/*
+ * mm_region_alloc - Allocate size bytes from a region, by bumping its
+ *     pointer in the current chunk.
+ */
+void *mm_region_alloc(struct mm_region *region, size_t size) {
+  size_t bytes = ALIGN(size);
+  if (size == 0 || bytes < size) {
+    return NULL;
+  }
+  if (bytes <= static_cast(region->end_ - region->top_, size_t)) {
+    void *res = region->top_;
+    region->top_ += bytes;
+    return res;
+  }
+  if (bytes > (size_t)-1 - region_chunk_sz()) {
+    return NULL;
+  }
+  if (bytes > region->chunk_sz_ / MM_REGION_SOLO) {
+    // a chunk of its own, behind the current one.
+    struct region_chunk *solo = mm_malloc(region_chunk_sz() + bytes);
+    if (solo == MMEOL) {
+      return NULL;
+    }
+    solo->next_ = region->chunks_->next_;
+    region->chunks_->next_ = solo;
+    return (void *)solo + region_chunk_sz();
+  }
+  struct region_chunk *chunk = mm_malloc(region->chunk_sz_);
+  if (chunk == MMEOL) {
+    return NULL;
+  }
+  chunk->next_ = region->chunks_;
+  region->chunks_ = chunk;
+  region->top_ = (char *)chunk + region_chunk_sz() + bytes;
+  region->end_ = (char *)chunk + region->chunk_sz_;
+  return (void *)chunk + region_chunk_sz();
+}
+
+/*
+ * mm_region_reset - Free everything allocated from a region at once. The
+ *     region keeps its first chunk.
+ */
+void mm_region_reset(struct mm_region *region) {
+  struct region_chunk *first = region_first(region);
+  struct region_chunk *it = region->chunks_;
+  while (it != MMEOL) {
+    struct region_chunk *next = it->next_;
+    if (it != first) {
+      mm_free(it);
+    }
+    it = next;
+  }
+  first->next_ = MMEOL;
+  region->chunks_ = first;
+  region_rewind(region);
+}
+
+/*
+ * mm_region_destroy - Free everything allocated from a region, and the
+ *     region itself.
+ */
+void mm_region_destroy(struct mm_region *region) {
+  if (region == NULL) {
+    return;
+  }
+  mm_region_reset(region);
+  mm_free(region_first(region));
+}
+
+/**
+ * @return offset of the first object in a slab of pool.
+ */
+static inline size_t pool_first(struct mm_pool *pool) {
+  return pool->align_;
+}
+
+/**
+ * @brief take a free object from pool, carving a new slab if needed. The
+ * caller holds the lock of pool.
+ * @return the object, or MMEOL if out of memory.
+ */
+static void *pool_take(struct mm_pool *pool) {
+  void *obj = pool->free_;
+  if (obj != MMEOL) {
+    pool->free_ = static_cast(obj, void **)[0];
+    return obj;
+  }
+  if (static_cast(pool->end_ - pool->top_, size_t) < pool->obj_sz_) {
+    struct pool_slab *slab = mm_memalign(pool->align_, pool->slab_sz_);
+    if (slab == MMEOL) {
+      return MMEOL;
+    }
+    slab->next_ = pool->slabs_;
+    pool->slabs_ = slab;
+    pool->top_ = (char *)slab + pool_first(pool);
+    pool->end_ = (char *)slab + pool->slab_sz_;
+  }
+  obj = pool->top_;
+  pool->top_ += pool->obj_sz_;
+  return obj;
+}
+
+/**
+ * @brief give obj back to pool. The caller holds the lock of pool.
+ */
+static inline void pool_give(struct mm_pool *pool, void *obj) {
+  static_cast(obj, void **)[0] = pool->free_;
+  pool->free_ = obj;
+}
+
+#ifdef MM_THREADS
+/**
+ * @brief give back the objects of mag down to keep of them. The caller
+ * holds the lock of its pool.
+ */
+static void magazine_flush(struct magazine *mag, unsigned int keep) {
+  while (mag->count_ > keep) {
+    void *obj = mag->head_;
+    mag->head_ = static_cast(obj, void **)[0];
+    --mag->count_;
+    pool_give(mag->pool_, obj);
+  }
+}
+
+/**
+ * @brief destructor of the key of a pool: flush the magazine of the exiting
+ * thread, and free it.
+ */
+static void magazine_release(void *ptr) {
+  struct magazine *mag = static_cast(ptr, struct magazine *);
+  struct mm_pool *pool = mag->pool_;
+  pthread_mutex_lock(&pool->lock_);
+  magazine_flush(mag, 0);
+  if (mag->prev_ != NULL) {
+    mag->prev_->next_ = mag->next_;
+  } else {
+    pool->mags_ = mag->next_;
+  }
+  if (mag->next_ != NULL) {
+    mag->next_->prev_ = mag->prev_;
+  }
+  pthread_mutex_unlock(&pool->lock_);
+  mm_free(mag);
+}
+
+/**
+ * @return the magazine of the calling thread for pool, made on first use;
+ * NULL if there is no memory for one.
+ */
+static struct magazine *pool_magazine(struct mm_pool *pool) {
+  struct magazine *mag = pthread_getspecific(pool->key_);
+  if (mag != NULL) {
+    return mag;
+  }
+  mag = mm_malloc(sizeof(struct magazine));
+  if (mag == NULL) {
+    return NULL;
+  }
+  mag->pool_ = pool;
+  mag->head_ = MMEOL;
+  mag->count_ = 0;
+  mag->prev_ = NULL;
+  pthread_mutex_lock(&pool->lock_);
+  mag->next_ = pool->mags_;
+  if (mag->next_ != NULL) {
+    mag->next_->prev_ = mag;
+  }
+  pool->mags_ = mag;
+  pthread_mutex_unlock(&pool->lock_);
+  pthread_setspecific(pool->key_, mag);
+  return mag;
+}
+#endif
+
+/*
+ * mm_pool_create - Create a pool of objects of obj_size bytes each, aligned
+ *     to align(0 for ALIGNMENT), which must be a power of two.
+ */
+struct mm_pool *mm_pool_create(size_t obj_size, size_t align) {
+  if (align == 0) {
+    align = ALIGNMENT;
+  }
+  if ((align & (align - 1)) != 0 || obj_size == 0 ||
+      obj_size > MM_MMAP_THRESHOLD) {
+    return NULL;
+  }
+  if (align < sizeof(void *)) {
+    align = sizeof(void *);
+  }
+  struct mm_pool *pool = mm_malloc(sizeof(struct mm_pool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  pool->free_ = MMEOL;
+  pool->top_ = pool->end_ = NULL;
+  pool->slabs_ = NULL;
+  pool->obj_sz_ = (obj_size + align - 1) & ~(align - 1);
+  pool->align_ = align > MM_POOL_LINE ? align : MM_POOL_LINE;
+  pool->slab_sz_ = pool_first(pool) + MM_POOL_MIN_OBJS * pool->obj_sz_;
+  if (pool->slab_sz_ < MM_POOL_SLAB) {
+    pool->slab_sz_ = MM_POOL_SLAB;
+  }
+#ifdef MM_THREADS
+  pool->mags_ = NULL;
+  if (pthread_key_create(&pool->key_, magazine_release) != 0) {
+    mm_free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock_, NULL);
+#endif
+  return pool;
+}
+
+/*
+ * mm_pool_get - Take an object from a pool, in O(1).
+ */
+void *mm_pool_get(struct mm_pool *pool) {
+#ifdef MM_THREADS
+  struct magazine *mag = pool_magazine(pool);
+  void *obj;
+  if (mag == NULL) {
+    pthread_mutex_lock(&pool->lock_);
+    obj = pool_take(pool);
+    pthread_mutex_unlock(&pool->lock_);
+    return obj;
+  }
+  if (mag->count_ == 0) {
+    // run dry, take a batch from the pool.
+    pthread_mutex_lock(&pool->lock_);
+    while (mag->count_ < MM_POOL_BATCH && (obj = pool_take(pool)) != MMEOL) {
+      static_cast(obj, void **)[0] = mag->head_;
+      mag->head_ = obj;
+      ++mag->count_;
+    }
+    pthread_mutex_unlock(&pool->lock_);
+    if (mag->count_ == 0) {
+      return NULL;
+    }
+  }
+  obj = mag->head_;
+  mag->head_ = static_cast(obj, void **)[0];
+  --mag->count_;
+  return obj;
+#else
+  return pool_take(pool);
+#endif
+}
+
+/*
+ * mm_pool_put - Give an object back to the pool it was taken from.
+ */
+void mm_pool_put(struct mm_pool *pool, void *obj) {
+  if (obj == NULL) {
+    return;
+  }
+#ifdef MM_THREADS
+  struct magazine *mag = pool_magazine(pool);
+  if (mag == NULL) {
+    pthread_mutex_lock(&pool->lock_);
+    pool_give(pool, obj);
+    pthread_mutex_unlock(&pool->lock_);
+    return;
+  }
+  static_cast(obj, void **)[0] = mag->head_;
+  mag->head_ = obj;
+  if (++mag->count_ >= MM_POOL_MAG) {
+    // full, give a batch back.
+    pthread_mutex_lock(&pool->lock_);
+    magazine_flush(mag, MM_POOL_MAG - MM_POOL_BATCH);
+    pthread_mutex_unlock(&pool->lock_);
+  }
+#else
+  pool_give(pool, obj);
+#endif
+}
+
+/*
+ * mm_pool_destroy - Free a pool with all of its objects, in O(slabs). No
+ *     thread may use the pool any more.
+ */
+void mm_pool_destroy(struct mm_pool *pool) {
+  if (pool == NULL) {
+    return;
+  }
+#ifdef MM_THREADS
+  // the magazines of other threads go too; their destructors won't run.
+  pthread_key_delete(pool->key_);
+  while (pool->mags_ != NULL) {
+    struct magazine *next = pool->mags_->next_;
+    mm_free(pool->mags_);
+    pool->mags_ = next;
+  }
+  pthread_mutex_destroy(&pool->lock_);
+#endif
+  while (pool->slabs_ != NULL) {
+    struct pool_slab *next = pool->slabs_->next_;
+    mm_free(pool->slabs_);
+    pool->slabs_ = next;
+  }
+  mm_free(pool);
+}
+
+#ifdef MM_STATS
+/**
+ * @brief count the blocks of the subtree at node, their bytes, and the
+ * largest of them.
+ */
+static void stat_tree(void *node, size_t *count, size_t *bytes,
+                      size_t *largest) {
+  if (node == MMEOL) {
+    return;
+  }
+  struct tree_meta *meta = static_cast(node, struct tree_meta *);
+  ++*count;
+  *bytes += blk_size(node);
+  if (blk_size(node) > *largest) {
+    *largest = blk_size(node);
+  }
+  stat_tree(blk_at(meta->left_), count, bytes, largest);
+  stat_tree(blk_at(meta->right_), count, bytes, largest);
+}
+
+/*
+ * mm_stats - Print the counters of the allocator, and what the free lists
+ *     of all arenas hold right now.
+ */
+void mm_stats(void) {
+  size_t count[MM_NUM_CLASSES + 1] = {0};
+  size_t bytes[MM_NUM_CLASSES + 1] = {0};
+  size_t largest = 0;
+  size_t fast = 0;
+  for (size_t i = 0; i < MM_ARENAS; ++i) {
+    struct arena *ar = &mm_arenas[i];
+#ifdef MM_THREADS
+    pthread_mutex_lock(&ar->lock_);
+#endif
+    for (size_t idx = 0; idx < MM_NUM_CLASSES; ++idx) {
+      for (void *it = ar->bins_[idx]; it != MMEOL;
+           it = blk_at(static_cast(it, struct free_meta *)->succ_)) {
+        ++count[idx];
+        bytes[idx] += blk_size(it);
+        if (blk_size(it) > largest) {
+          largest = blk_size(it);
+        }
+      }
+    }
+    stat_tree(ar->tree_, &count[MM_NUM_CLASSES], &bytes[MM_NUM_CLASSES],
+              &largest);
+    fast += ar->fast_bytes_;
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&ar->lock_);
+#endif
+  }
+
+  size_t total = 0;
+  printf("%-8s %10s %10s %10s %8s %12s\n", "class", "malloc", "free",
+         "realloc", "blocks", "free bytes");
+  for (size_t idx = 0; idx < MM_STAT_CLASSES; ++idx) {
+    size_t blocks = idx <= MM_NUM_CLASSES ? count[idx] : 0;
+    size_t free_bytes = idx <= MM_NUM_CLASSES ? bytes[idx] : 0;
+    total += free_bytes;
+    if (mm_stat.malloc_[idx] == 0 && mm_stat.free_[idx] == 0 &&
+        mm_stat.realloc_[idx] == 0 && blocks == 0) {
+      continue;
+    }
+    if (idx < MM_NUM_CLASSES) {
+      printf("%-8u", mm_class_min[idx]);
+    } else {
+      printf("%-8s", idx == MM_NUM_CLASSES ? "tree" : "mapped");
+    }
+    printf(" %10lu %10lu %10lu %8zu %12zu\n", mm_stat.malloc_[idx],
+           mm_stat.free_[idx], mm_stat.realloc_[idx], blocks, free_bytes);
+  }
+  printf("find_fit steps:");
+  for (size_t i = 0; i <= MM_FIT_PROBES; ++i) {
+    printf(" %zu:%lu", i, mm_stat.fit_steps_[i]);
+  }
+  printf(" (%lu missed)\n", mm_stat.fit_miss_);
+  printf("splits: %lu, coalesces: %lu\n", mm_stat.split_, mm_stat.coalesce_);
+  // external fragmentation: how much of the free memory is not in the
+  // largest free block.
+  printf("free: %zu bytes(and %zu in fast bins), largest block: %zu, "
+         "fragmentation: %.3f\n",
+         total, fast, largest,
+         total == 0 ? 0.0 : 1.0 - static_cast(largest, double) / total);
+}
+#endif
+
+#ifdef MM_PROFILE
+/**
+ * @brief append rec to the n records in buf, writing them to fd when buf
+ * is full.
+ * @return non zero if the write fails.
+ */
+static int dump_rec(int fd, struct heap_rec *buf, size_t *n,
+                    struct heap_rec rec) {
+  buf[(*n)++] = rec;
+  if (*n < 256) {
+    return 0;
   }
+  size_t bytes = *n * sizeof(struct heap_rec);
+  *n = 0;
+  return write(fd, buf, bytes) != static_cast(bytes, ssize_t);
+}
 
-  add_free_blk(res);
-  check();
+/**
+ * @brief add the blocks from blk up to top to the map.
+ * @return non zero if the write fails.
+ */
+static int dump_blks(int fd, struct heap_rec *buf, size_t *n, void *blk,
+                     void *top) {
+  for (; blk < top; blk += blk_size(blk)) {
+    size_t word = static_cast(blk, size_t *)[0];
+    struct heap_rec rec = {static_cast(blk - mem_heap_lo(), uint32_t),
+                           static_cast(blk_size(blk), uint32_t), HEAP_FREE, 0,
+                           0};
+    if ((word & MM_USED) != 0) {
+      rec.state = is_slab(blk + used_meta_sz()) ? HEAP_SLAB : HEAP_USED;
+    }
+    if ((word & MM_USED) != 0 && (word & MM_SAMPLED) != 0) {
+      unsigned int off = blk_off(blk);
+      for (size_t i = sample_slot(off); mm_samples[i].off_ != 0;
+           i = (i + 1) & (MM_PROFILE_SLOTS - 1)) {
+        if (mm_samples[i].off_ == off) {
+          rec.request = mm_samples[i].size_;
+          rec.site = static_cast(mm_samples[i].site_, uintptr_t);
+          break;
+        }
+      }
+    }
+    if (dump_rec(fd, buf, n, rec) != 0) {
+      return -1;
+    }
+  }
+  return 0;
 }
 
 /*
- * mm_realloc - Implemented simply in terms of mm_malloc and mm_free
+ * mm_dump_heap - Write a map of every block of the heap to fd, in the
+ *     format of heapmap.h. Blocks sampled by the profiler carry their
+ *     allocation site.
  */
-void *mm_realloc(void *ptr, size_t size) {
-  void *oldptr = ptr;
-  void *newptr;
-  size_t copySize;
-
-  newptr = mm_malloc(size);
-  if (newptr == NULL)
-    return NULL;
-  copySize = *(size_t *)((char *)oldptr - SIZE_T_SIZE);
-  if (size < copySize)
-    copySize = size;
-  memcpy(newptr, oldptr, copySize);
-  mm_free(oldptr);
-  return newptr;
+int mm_dump_heap(int fd) {
+  struct heap_rec buf[256];
+  size_t n = 0;
+  struct heap_hdr hdr = {HEAP_MAGIC, MM_PROFILE_RATE,
+                         static_cast(mem_heap_lo(), uintptr_t)};
+  if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    return -1;
+  }
+  int res = 0;
+#ifdef MM_THREADS
+  // hold everything still: every arena, and the chunks.
+  for (size_t i = 0; i < MM_ARENAS; ++i) {
+    pthread_mutex_lock(&mm_arenas[i].lock_);
+  }
+  pthread_mutex_lock(&mm_chunk_lock);
+  pthread_mutex_lock(&mm_sample_lock);
+  void *chunk = mm_base;
+  while (res == 0 && chunk < mem_heap_hi() + 1) {
+    size_t size = static_cast(chunk, struct chunk_meta *)->size_;
+    res = dump_blks(fd, buf, &n, chunk + sizeof(struct chunk_meta),
+                    chunk + size - ALIGNMENT);
+    // the next chunk starts at a granule.
+    chunk = mm_base + ((chunk + size - mm_base + MM_GRANULE - 1) &
+                       ~static_cast(MM_GRANULE - 1, size_t));
+  }
+  pthread_mutex_unlock(&mm_sample_lock);
+  pthread_mutex_unlock(&mm_chunk_lock);
+  for (size_t i = 0; i < MM_ARENAS; ++i) {
+    pthread_mutex_unlock(&mm_arenas[i].lock_);
+  }
+#else
+  // skip the prologue.
+  res = dump_blks(fd, buf, &n, mm_base + ALIGNMENT, heap_top());
+#endif
+  if (res == 0 && n != 0 &&
+      write(fd, buf, n * sizeof(struct heap_rec)) !=
+          static_cast(n * sizeof(struct heap_rec), ssize_t)) {
+    res = -1;
+  }
+  return res;
 }
+#endif
 
 /************************************************
  * Helper Functions Implementation
  ************************************************/
-void *find_fit(void *head, size_t size) {
+/**
+ * @return size of a mapping that holds a payload of size bytes, whose
+ * header starts lead bytes into the mapping.
+ */
+static inline size_t map_need(size_t lead, size_t size) {
+  size_t page = mem_pagesize();
+  return (lead + used_meta_sz() + size + page - 1) & ~(page - 1);
+}
+
+/**
+ * @return the start of the mapping of a mapped block.
+ */
+static inline void *map_base(void *blk) {
+  return static_cast(static_cast(blk, size_t) & ~(mem_pagesize() - 1),
+                     void *);
+}
+
+void *map_alloc(size_t align, size_t size) {
+  // map enough to find an aligned payload, then unmap the pages around it.
+  size_t bytes = map_need(align - ALIGNMENT, size);
+  void *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    return MMEOL;
+  }
+  size_t payload = (static_cast(map + used_meta_sz(), size_t) + align - 1) &
+                   ~(align - 1);
+  void *blk = static_cast(payload, void *) - used_meta_sz();
+  void *base = map_base(blk);
+  void *end = base + map_need(blk - base, size);
+  if (base != map) {
+    munmap(map, base - map);
+  }
+  if (end != map + bytes) {
+    munmap(end, map + bytes - end);
+  }
+  static_cast(blk, size_t *)[0] = (end - base) | MM_MAPPED | MM_USED;
+  return blk + used_meta_sz();
+}
+
+void map_free(void *ptr) {
+  void *blk = ptr - used_meta_sz();
+#ifdef DEBUG
+  assert((static_cast(blk, size_t *)[0] & MM_MAPPED) != 0);
+#endif
+  munmap(map_base(blk), blk_size(blk));
+}
+
+void *map_realloc(void *ptr, size_t size) {
+  void *res;
+  if (!is_mapped(ptr)) {
+    // leave the heap for a mapping of its own.
+    size_t old = usable_size(ptr);
+    res = map_alloc(ALIGNMENT, size);
+    if (res != MMEOL) {
+      memcpy(res, ptr, old < size ? old : size);
+      mm_free(ptr);
+    }
+    return res;
+  }
+  if (size == 0) {
+    map_free(ptr);
+    return NULL;
+  }
+  void *blk = ptr - used_meta_sz();
+  void *base = map_base(blk);
+  size_t old = blk_size(blk);
+  if (size < MM_MMAP_THRESHOLD) {
+    // small enough for the heap again.
+    res = route_malloc(size);
+    if (res != NULL) {
+      memcpy(res, ptr, size);
+      munmap(base, old);
+    }
+    return res;
+  }
+  size_t lead = blk - base;
+  size_t bytes = map_need(lead, size);
+  // the kernel moves the pages, not their contents.
+  base = mremap(base, old, bytes, MREMAP_MAYMOVE);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+  blk = base + lead;
+  static_cast(blk, size_t *)[0] = bytes | MM_MAPPED | MM_USED;
+  return blk + used_meta_sz();
+}
+
+#ifdef MM_PROFILE
+void profile_alloc(void *ptr, size_t size, void *site) {
+  if (++mm_sample_tick < MM_PROFILE_RATE) {
+    return;
+  }
+  mm_sample_tick = 0;
+  if (ptr == NULL || is_mapped(ptr) || is_slab(ptr)) {
+    return;
+  }
+  void *blk = ptr - used_meta_sz();
+  unsigned int off = blk_off(blk);
+#ifdef MM_THREADS
+  struct arena *owner = arena_of(ptr);
+  pthread_mutex_lock(&owner->lock_);
+  pthread_mutex_lock(&mm_sample_lock);
+#endif
+  // keep the table half empty, so that probing stays short.
+  if ((static_cast(blk, size_t *)[0] & MM_SAMPLED) == 0 &&
+      mm_nsamples < MM_PROFILE_SLOTS / 2) {
+    size_t i = sample_slot(off);
+    while (mm_samples[i].off_ != 0) {
+      i = (i + 1) & (MM_PROFILE_SLOTS - 1);
+    }
+    mm_samples[i].off_ = off;
+    mm_samples[i].size_ = size;
+    mm_samples[i].site_ = site;
+    ++mm_nsamples;
+    static_cast(blk, size_t *)[0] |= MM_SAMPLED;
+  }
+#ifdef MM_THREADS
+  pthread_mutex_unlock(&mm_sample_lock);
+  pthread_mutex_unlock(&owner->lock_);
+#endif
+}
+
+void profile_free(void *ptr, int locked) {
+  if (is_slab(ptr)) {
+    return;
+  }
+  void *blk = ptr - used_meta_sz();
+  // only the one who frees ptr may clear the tag, so it can't go away.
+  if ((static_cast(blk, size_t *)[0] & MM_SAMPLED) == 0) {
+    return;
+  }
+  unsigned int off = blk_off(blk);
+#ifdef MM_THREADS
+  struct arena *owner = arena_of(ptr);
+  if (!locked) {
+    pthread_mutex_lock(&owner->lock_);
+  }
+  pthread_mutex_lock(&mm_sample_lock);
+#else
+  (void)locked;
+#endif
+  static_cast(blk, size_t *)[0] &= ~static_cast(MM_SAMPLED, size_t);
+  size_t i = sample_slot(off);
+  size_t probes = 0;
+  while (mm_samples[i].off_ != off && mm_samples[i].off_ != 0 &&
+         ++probes < MM_PROFILE_SLOTS) {
+    i = (i + 1) & (MM_PROFILE_SLOTS - 1);
+  }
+  if (mm_samples[i].off_ == off) {
+    // move later records of the run back, so that no search stops early.
+    for (size_t j = (i + 1) & (MM_PROFILE_SLOTS - 1);
+         mm_samples[j].off_ != 0; j = (j + 1) & (MM_PROFILE_SLOTS - 1)) {
+      size_t home = sample_slot(mm_samples[j].off_);
+      if (((j - home) & (MM_PROFILE_SLOTS - 1)) >=
+          ((j - i) & (MM_PROFILE_SLOTS - 1))) {
+        mm_samples[i] = mm_samples[j];
+        i = j;
+      }
+    }
+    mm_samples[i].off_ = 0;
+    --mm_nsamples;
+  }
+#ifdef MM_THREADS
+  pthread_mutex_unlock(&mm_sample_lock);
+  if (!locked) {
+    pthread_mutex_unlock(&owner->lock_);
+  }
+#endif
+}
+#endif
+
+void *find_free(size_t bytes) {
+  void *res = MMEOL;
+  if (bytes < MM_TREE_MIN) {
+    // blocks in the class of the request may still be too small; probe them.
+    size_t idx = size_class(bytes);
+    res = find_fit(idx, bytes);
+    if (res == MMEOL) {
+      // any block in the smallest larger class will do.
+      idx = find_bin(idx + 1);
+      res = idx < MM_NUM_CLASSES ? find_fit(idx, bytes) : MMEOL;
+    }
+  }
+  if (res == MMEOL) {
+    res = tree_fit(bytes);
+  }
+  return res;
+}
+
+/**
+ * @return number of bytes to skip from blk, so that the payload of a block
+ * there is aligned to align. It is either 0 or large enough to be a free
+ * block.
+ */
+static size_t aligned_lead(void *blk, size_t align) {
+  size_t payload = static_cast(blk + used_meta_sz(), size_t);
+  size_t lead = ((payload + align - 1) & ~(align - 1)) - payload;
+  while (lead != 0 && lead < free_meta_sz()) {
+    lead += align;
+  }
+  return lead;
+}
+
+void *alloc_aligned(size_t align, size_t bytes) {
+  // any free block this large has room for an aligned block, and for a free
+  // block in front of it.
+  void *blk = find_free(bytes + align + free_meta_sz());
+  if (blk == MMEOL) {
+    // grow the heap so that end_blk_ has room for an aligned block.
+    void *end = mm_arena->end_blk_;
+    size_t total = bytes + align + free_meta_sz();
+    if (end != NULL) {
+      int end_free = (static_cast(end, size_t *)[0] & MM_USED) == 0;
+      void *start = end_free ? end : end + blk_size(end);
+      total = aligned_lead(start, align) + bytes;
+#ifdef MM_THREADS
+      // the heap may grow by a new chunk instead, which starts elsewhere.
+      total += align + free_meta_sz();
+#endif
+      if (end_free && total < blk_size(end)) {
+        total = blk_size(end);
+      }
+    }
+    if (grow_heap(total) != 0) {
+      return MMEOL;
+    }
+    blk = mm_arena->end_blk_;
+  }
+
+  size_t lead = aligned_lead(blk, align);
+#ifdef DEBUG
+  assert(blk_size(blk) >= lead + bytes);
+#endif
+  if (lead != 0) {
+    // split off the skipped bytes as a free block of its own.
+    MM_STAT(split_, 1);
+    remove_free_blk(blk);
+    void *rest = blk + lead;
+    static_cast(rest, size_t *)[0] = blk_size(blk) - lead;
+    set_footer(rest);
+    static_cast(blk, size_t *)[0] =
+        lead | (static_cast(blk, size_t *)[0] & MM_TAGS);
+    set_footer(blk);
+    if (blk == mm_arena->end_blk_) {
+      mm_arena->end_blk_ = rest;
+    }
+    add_free_blk(blk);
+    add_free_blk(rest);
+    blk = rest;
+  }
+  take(blk, bytes);
+  return blk;
+}
+
+/**
+ * @brief put a slab at the front of the list of its class.
+ */
+static void slab_link(void *slab, size_t cls) {
+  struct slab_meta *meta = static_cast(slab, struct slab_meta *);
+  meta->pred_ = 0;
+  meta->succ_ = blk_off(mm_arena->slabs_[cls]);
+  if (mm_arena->slabs_[cls] != MMEOL) {
+    static_cast(mm_arena->slabs_[cls], struct slab_meta *)->pred_ =
+        blk_off(slab);
+  }
+  mm_arena->slabs_[cls] = slab;
+}
+
+/**
+ * @brief remove a slab from the list of its class.
+ */
+static void slab_unlink(void *slab, size_t cls) {
+  struct slab_meta *meta = static_cast(slab, struct slab_meta *);
+  if (meta->pred_ != 0) {
+    static_cast(blk_at(meta->pred_), struct slab_meta *)->succ_ = meta->succ_;
+  } else {
+    mm_arena->slabs_[cls] = blk_at(meta->succ_);
+  }
+  if (meta->succ_ != 0) {
+    static_cast(blk_at(meta->succ_), struct slab_meta *)->pred_ = meta->pred_;
+  }
+  meta->pred_ = meta->succ_ = 0;
+}
+
+/**
+ * @brief carve a new slab for class cls out of the heap, and put it on the
+ * list of the class.
+ * @return the slab, MMEOL if out of memory.
+ */
+static void *slab_new(size_t cls) {
+  void *blk = alloc_aligned(MM_SLAB_SIZE, MM_SLAB_SIZE + used_meta_sz());
+  if (blk == MMEOL) {
+    return MMEOL;
+  }
+  void *slab = blk + used_meta_sz();
+  struct slab_meta *meta = static_cast(slab, struct slab_meta *);
+  size_t slot = (cls + 1) * ALIGNMENT;
+  // the bitmap takes at most a bit per slot of the page.
+  size_t words = ((MM_SLAB_SIZE - sizeof(struct slab_meta)) / slot + 31) / 32;
+  meta->slot_ = slot;
+  meta->first_ = ALIGN(sizeof(struct slab_meta) + words * sizeof(unsigned int));
+  meta->nslot_ = (MM_SLAB_SIZE - meta->first_) / slot;
+  meta->used_ = 0;
+  meta->hint_ = 0;
+  memset(meta->map_, 0, words * sizeof(unsigned int));
+  for (size_t i = 0; i < meta->nslot_; ++i) {
+    meta->map_[i / 32] |= 1U << (i % 32);
+  }
+
+  mark_slab(slab, 1);
+  slab_link(slab, cls);
+  return slab;
+}
+
+void *slab_alloc(size_t size) {
+  size_t cls = ALIGN(size) / ALIGNMENT - 1;
+  void *slab = mm_arena->slabs_[cls];
+  if (slab == MMEOL) {
+    slab = slab_new(cls);
+    if (slab == MMEOL) {
+      return MMEOL;
+    }
+  }
+  struct slab_meta *meta = static_cast(slab, struct slab_meta *);
+#ifdef DEBUG
+  assert(meta->used_ < meta->nslot_);
+#endif
+  size_t w = meta->hint_;
+  while (meta->map_[w] == 0) {
+    ++w;
+  }
+  size_t bit = __builtin_ctz(meta->map_[w]);
+  meta->map_[w] &= ~(1U << bit);
+  meta->hint_ = w;
+  if (++meta->used_ == meta->nslot_) {
+    // full, no longer a candidate.
+    slab_unlink(slab, cls);
+  }
+  return slab + meta->first_ + (w * 32 + bit) * meta->slot_;
+}
+
+void slab_free(void *ptr) {
+  void *slab = slab_of(ptr);
+  struct slab_meta *meta = static_cast(slab, struct slab_meta *);
+  size_t cls = meta->slot_ / ALIGNMENT - 1;
+  size_t idx = static_cast(ptr - slab - meta->first_, size_t) / meta->slot_;
+#ifdef DEBUG
+  // is ptr a slot in use?
+  assert(ptr >= slab + meta->first_);
+  assert(static_cast(ptr - slab - meta->first_, size_t) % meta->slot_ == 0);
+  assert(idx < meta->nslot_);
+  assert((meta->map_[idx / 32] & (1U << (idx % 32))) == 0);
+#endif
+  meta->map_[idx / 32] |= 1U << (idx % 32);
+  if (idx / 32 < meta->hint_) {
+    meta->hint_ = idx / 32;
+  }
+  if (meta->used_-- == meta->nslot_) {
+    // was full, becomes a candidate again.
+    slab_link(slab, cls);
+  }
+  if (meta->used_ == 0 && (meta->pred_ != 0 || meta->succ_ != 0)) {
+    // empty and not the last one of its class: give the page back.
+    slab_unlink(slab, cls);
+    mark_slab(slab, 0);
+    free_blk(slab - used_meta_sz());
+  }
+}
+
+void *find_fit(size_t idx, size_t size) {
+  void *head = mm_arena->bins_[idx];
   void *it = head;
+#if MM_FIT == MM_FIT_NEXT
+  if (mm_arena->rover_[idx] != MMEOL) {
+    it = mm_arena->rover_[idx];
+  }
+  void *start = it;
+#endif
   struct free_meta *meta;
   size_t volume;
 
-  // recall: free block layout [size | last | pred | succ ]
-  while (it != MMEOL) {
-    meta = static_cast(it, struct free_meta *);
-    volume = meta->size_;
-#ifdef DEBUG
-    // on the free list: unused and aligned.
-    assert((volume & 0x7) == 0);
-#endif
-    if (volume >= size + used_meta_sz()) {
-      // found!
-      return it;
+#if MM_FIT == MM_FIT_BEST
+  // no block of the class is smaller than this; stop at one.
+  size_t least = size > mm_class_min[idx] ? size : mm_class_min[idx];
+  void *best = MMEOL;
+#else
+  if (it != MMEOL && size <= mm_class_min[idx]) {
+    // every block of the class fits.
+#if MM_FIT == MM_FIT_NEXT
+    mm_arena->rover_[idx] = blk_at(static_cast(it, struct free_meta *)->succ_);
+#endif
+    return it;
+  }
+#endif
+
+  int probes;
+
+  // recall: free block layout [size | pred | succ | ... | size ]
+  for (probes = 0; it != MMEOL && probes < MM_FIT_PROBES; ++probes) {
+    meta = static_cast(it, struct free_meta *);
+    volume = meta->size_;
+#ifdef DEBUG
+    // on the free list: unused.
+    assert((volume & MM_USED) == 0);
+#endif
+    volume &= ~MM_TAGS;
+#if MM_FIT == MM_FIT_BEST
+    if (volume >= size && (best == MMEOL || volume < blk_size(best))) {
+      best = it;
+      if (volume == least) {
+        ++probes;
+        break;
+      }
+    }
+#else
+    if (volume >= size) {
+      // found!
+#if MM_FIT == MM_FIT_NEXT
+      mm_arena->rover_[idx] = blk_at(meta->succ_);
+#endif
+      MM_STAT(fit_steps_[probes + 1], 1);
+      return it;
+    }
+#endif
+
+    // else it = it->succ;
+    it = blk_at(meta->succ_);
+#if MM_FIT == MM_FIT_NEXT
+    // wrap around to the head, until back at the start.
+    if (it == MMEOL && start != head) {
+      it = head;
+    }
+    if (it == start) {
+      it = MMEOL;
+    }
+#endif
+  }
+
+#if MM_FIT == MM_FIT_BEST
+  if (best != MMEOL) {
+    MM_STAT(fit_steps_[probes], 1);
+    return best;
+  }
+#endif
+  MM_STAT(fit_steps_[probes], 1);
+  MM_STAT(fit_miss_, 1);
+  return MMEOL;
+}
+
+void take(void *node, size_t bytes) {
+  struct free_meta *meta = static_cast(node, struct free_meta *);
+  // NOTE: Your solution should gurantee that there's no continuous free blocks.
+  // And you can also assume this fact in your impl.
+#ifdef DEBUG
+  // the size is aligned
+  assert((bytes & 0x7) == 0);
+  // the size is non-zero
+  assert(bytes > 0U);
+  // node is valid
+  assert(node && node != (void *)-1);
+  // volume is avaliable and enough
+  assert((meta->size_ & MM_USED) == 0);
+  assert(blk_size(node) >= bytes);
+#endif
+
+  // evict off the free list(won't affect end_blk_)
+  remove_free_blk(node);
+
+  size_t remain = blk_size(node) - bytes;
+  meta->size_ |= MM_USED;
+
+  if (remain < free_meta_sz() + MINVOL) {
+    // too small, don't mind. have to allocate all of them to the request.
+    void *next = get_next(node);
+    if (next != MMEOL) {
+      static_cast(next, size_t *)[0] |= MM_PREV_USED;
+    }
+    if (node == mm_arena->end_blk_) {
+      mark_dirty(node + blk_size(node));
+    }
+    check_blk(node);
+    return;
+  }
+  // else, split the node and reuse the rest.
+
+  // set the size of meta; mark as used.
+  MM_STAT(split_, 1);
+  meta->size_ = bytes | (meta->size_ & MM_TAGS);
+  // rest of the block(free), its right neighbor already knows it is free.
+  void *rest = node + bytes;
+  struct free_meta *rest_meta = static_cast(rest, struct free_meta *);
+  rest_meta->size_ = remain | MM_PREV_USED;
+  set_footer(rest);
+  if (node == mm_arena->end_blk_) {
+    // end_blk_ should change.
+    mm_arena->end_blk_ = rest;
+    mark_dirty(rest + sizeof(struct free_meta));
+#ifdef DEBUG
+    assert(mm_arena->end_blk_ + remain == heap_top());
+#endif
+  }
+  // add_free_blk will handle its predecessor and successor.
+  add_free_blk(rest);
+  check_blk(node);
+  check_blk(rest);
+
+  // now you can give node + used_meta_sz() to user, good luck!
+}
+
+void free_blk(void *blk) {
+  struct free_meta *meta = static_cast(blk, struct free_meta *);
+#ifdef DEBUG
+  // make sure that you're not freeing a block that is free.
+  assert((meta->size_ & MM_USED) != 0);
+#endif
+  // mark as free block.
+  meta->size_ &= ~MM_USED;
+  set_footer(blk);
+  // next block in the heap.
+  void *next = get_next(blk);
+
+  // result block(to be added to free list)
+  void *res = blk;
+  size_t freed = blk_size(blk);
+  if (next != MMEOL) {
+    static_cast(next, size_t *)[0] &= ~MM_PREV_USED;
+    if ((static_cast(next, size_t *)[0] & MM_USED) == 0) {
+      // next block is not null and free! you should merge them.
+      remove_free_blk(next);
+      merge_blk(blk, next);
+    }
+  }
+
+  if ((meta->size_ & MM_PREV_USED) == 0) {
+    // last block is not null and free! you should merge them.
+    void *last = get_prev(blk);
+    remove_free_blk(last);
+    merge_blk(last, blk);
+    res = last;
+  }
+
+  add_free_blk(res);
+  if (res == mm_arena->end_blk_) {
+    trim_heap();
+  } else if (blk_size(res) >= MM_RELEASE_MIN) {
+    mm_arena->epoch_freed_ += freed;
+    if (mm_arena->epoch_freed_ >= MM_RELEASE_EPOCH) {
+      mm_arena->epoch_freed_ = 0;
+      ++mm_arena->epoch_;
+      release_free(mm_arena->tree_);
+    }
+  }
+  check_blk(res);
+}
+
+void release_free(void *node) {
+  size_t page = mem_pagesize();
+  while (node != MMEOL) {
+    struct tree_meta *meta = static_cast(node, struct tree_meta *);
+    if (blk_size(node) < MM_RELEASE_MIN) {
+      // the tree is ordered by size: only larger blocks on the right.
+      node = blk_at(meta->right_);
+      continue;
+    }
+    if (meta->epoch_ != MM_RELEASED && mm_arena->epoch_ - meta->epoch_ >= 2) {
+      // keep the header, links and footer; drop the pages in between.
+      size_t lo = (static_cast(node, size_t) + sizeof(struct tree_meta) +
+                   page - 1) & ~(page - 1);
+      size_t hi = (static_cast(node, size_t) + blk_size(node) -
+                   sizeof(size_t)) & ~(page - 1);
+      madvise(static_cast(lo, void *), hi - lo, MADV_DONTNEED);
+      meta->epoch_ = MM_RELEASED;
+    }
+    release_free(blk_at(meta->left_));
+    node = blk_at(meta->right_);
+  }
+}
+
+void trim_heap() {
+  void *end = mm_arena->end_blk_;
+  if ((static_cast(end, size_t *)[0] & MM_USED) != 0) {
+    return;
+  }
+  size_t size = blk_size(end);
+  size_t keep = grow_step();
+  if (size < MM_TRIM_MIN || size < 2 * keep) {
+    return;
+  }
+  size_t release = size - keep;
+#ifdef MM_THREADS
+  // only the chunk on top of the memlib heap can shrink.
+  pthread_mutex_lock(&mm_chunk_lock);
+  if (mm_arena->top_ + ALIGNMENT != mem_heap_hi() + 1 ||
+      mem_sbrk(-static_cast(release, int)) == (void *)-1) {
+    pthread_mutex_unlock(&mm_chunk_lock);
+    return;
+  }
+  pthread_mutex_unlock(&mm_chunk_lock);
+  void *chunk = mm_base + mm_chunk_map[static_cast(end - mm_base, size_t) >>
+                                       MM_GRANULE_SHIFT];
+  static_cast(chunk, struct chunk_meta *)->size_ -= release;
+  mm_arena->top_ -= release;
+  static_cast(mm_arena->top_, size_t *)[0] = MM_USED;
+#else
+  if (mem_sbrk(-static_cast(release, int)) == (void *)-1) {
+    return;
+  }
+#endif
+  remove_free_blk(end);
+  static_cast(end, size_t *)[0] =
+      keep | (static_cast(end, size_t *)[0] & MM_TAGS);
+  set_footer(end);
+  add_free_blk(end);
+  check_end();
+}
+
+void consolidate() {
+  for (size_t i = 0; i < MM_FAST_BINS; ++i) {
+    void *it = mm_arena->fast_[i];
+    while (it != MMEOL) {
+      void *next = blk_at(static_cast(it, struct fast_meta *)->succ_);
+      free_blk(it);
+      it = next;
+    }
+    mm_arena->fast_[i] = MMEOL;
+  }
+  mm_arena->fast_bytes_ = 0;
+}
+
+#ifdef MM_THREADS
+/**
+ * @return class of the thread caches for a request of size bytes,
+ * MM_TCACHE_CLASSES if such requests are not cached.
+ */
+static inline size_t tcache_class(size_t size) {
+  if (size == 0) {
+    return MM_TCACHE_CLASSES;
+  }
+  if (size < MM_SLAB_MAX) {
+    return ALIGN(size) / ALIGNMENT - 1;
+  }
+  size_t actual = blk_need(size);
+  return actual <= MM_FAST_MAX ? MM_SLAB_CLASSES + actual / ALIGNMENT
+                               : MM_TCACHE_CLASSES;
+}
+
+/**
+ * @brief give MM_TCACHE_BATCH payloads(or all, if all is non zero) of class
+ * idx in the cache of the calling thread back to their arenas.
+ */
+static void tcache_flush(struct tcache *cache, size_t idx, int all) {
+  int locked = 0;
+  while (cache->count_[idx] != 0 &&
+         (all || cache->count_[idx] > MM_TCACHE_MAX - MM_TCACHE_BATCH)) {
+    void *ptr = blk_at(cache->head_[idx]);
+    cache->head_[idx] = static_cast(ptr, unsigned int *)[0];
+    --cache->count_[idx];
+    struct arena *owner = arena_of(ptr);
+    if (owner != mm_home) {
+      // left from an arena the thread has moved away from.
+      remote_push(owner, ptr);
+      continue;
+    }
+    if (!locked) {
+      arena_enter(owner);
+      locked = 1;
     }
+    heap_free(ptr);
+  }
+  if (locked) {
+    arena_leave();
+  }
+}
 
-    // else it = it->succ;
-    it = static_cast(meta->succ_, void *);
+void remote_drain() {
+  unsigned int off = __atomic_load_n(&mm_arena->remote_, __ATOMIC_RELAXED);
+  if (off == 0) {
+    return;
+  }
+  off = __atomic_exchange_n(&mm_arena->remote_, 0, __ATOMIC_ACQUIRE);
+  while (off != 0) {
+    void *ptr = blk_at(off);
+    off = static_cast(ptr, unsigned int *)[0];
+    heap_free(ptr);
   }
+}
 
-#ifdef DEBUG
-  assert(it == MMEOL);
-#endif
-  return it;
+/**
+ * @brief destructor of mm_tcache_key: flush everything the exiting thread
+ * has cached.
+ */
+static void tcache_release(void *cache) {
+  for (size_t idx = 0; idx < MM_TCACHE_CLASSES; ++idx) {
+    tcache_flush(static_cast(cache, struct tcache *), idx, 1);
+  }
 }
 
-void take(void *node, size_t aligned) {
-  struct free_meta *meta = static_cast(node, struct free_meta *);
-  // NOTE: Your solution should gurantee that there's no continuous free blocks.
-  // And you can also assume this fact in your impl.
-#ifdef DEBUG
-  // the size is aligned
-  assert((aligned & 0x7) == 0);
-  // the size is non-zero
-  assert(aligned > 0U);
-  // node is valid
-  assert(node && node != (void *)-1);
-  // volume is avaliable and enough
-  assert((meta->size_ & 0x7) == 0);
-  assert(meta->size_ >= aligned + used_meta_sz());
-#endif
+static void tcache_key_init() {
+  pthread_key_create(&mm_tcache_key, tcache_release);
+}
 
-  /**
-   * Recall: layout of free block: [size | last | pred | succ]
-   */
-  struct free_meta *predecessor = static_cast(meta->pred_, struct free_meta *);
-  struct free_meta *successor = static_cast(meta->succ_, struct free_meta *);
-  struct free_meta *third = static_cast(node + meta->size_, struct free_meta *);
-  // evict off the free list(won't affect end_blk)
-  if (predecessor != NULL) {
-    predecessor->succ_ = static_cast(successor, size_t);
+void *tcache_get(size_t size) {
+  size_t idx = tcache_class(size);
+  if (idx >= MM_TCACHE_CLASSES) {
+    return MMEOL;
   }
-  if (successor != NULL) {
-    successor->pred_ = static_cast(predecessor, size_t);
+  struct tcache *cache = &mm_tcache;
+  if (cache->count_[idx] == 0) {
+    // run dry, take a batch from the arena.
+    arena_pick();
+    remote_drain();
+    while (cache->count_[idx] < MM_TCACHE_BATCH) {
+      void *ptr = heap_malloc(size);
+      if (ptr == NULL) {
+        break;
+      }
+      static_cast(ptr, unsigned int *)[0] = cache->head_[idx];
+      cache->head_[idx] = blk_off(ptr);
+      ++cache->count_[idx];
+    }
+    arena_leave();
+    if (cache->count_[idx] == 0) {
+      return MMEOL;
+    }
   }
-  if (node == mm_large) {
-    mm_large = static_cast(successor, void *);
+  void *ptr = blk_at(cache->head_[idx]);
+  cache->head_[idx] = static_cast(ptr, unsigned int *)[0];
+  --cache->count_[idx];
+  return ptr;
+}
+
+int tcache_put(void *ptr) {
+  // ptr is in use, so neither its slab nor its size can change under us,
+  // though its tags can.
+  size_t idx;
+  if (is_slab(ptr)) {
+    idx = static_cast(slab_of(ptr), struct slab_meta *)->slot_ / ALIGNMENT - 1;
+  } else {
+    size_t size = used_size(ptr - used_meta_sz());
+    if (size > MM_FAST_MAX) {
+      return -1;
+    }
+    idx = MM_SLAB_CLASSES + size / ALIGNMENT;
   }
-  if (node == mm_small) {
-    mm_small = static_cast(successor, void *);
+  struct tcache *cache = &mm_tcache;
+  if (!cache->registered_) {
+    pthread_once(&mm_tcache_once, tcache_key_init);
+    pthread_setspecific(mm_tcache_key, cache);
+    cache->registered_ = 1;
   }
-  if (node == mm_middle) {
-    mm_middle = static_cast(successor, void *);
+  static_cast(ptr, unsigned int *)[0] = cache->head_[idx];
+  cache->head_[idx] = blk_off(ptr);
+  if (++cache->count_[idx] > MM_TCACHE_MAX) {
+    tcache_flush(cache, idx, 0);
   }
+  return 0;
+}
+#endif
 
-  size_t remain = meta->size_ - aligned - used_meta_sz();
-  meta->size_ |= 0x1;
-
+void shrink_blk(void *blk, size_t bytes) {
+  struct used_meta *meta = static_cast(blk, struct used_meta *);
 #ifdef DEBUG
-  assert((meta->size_ & 0x7) != 0);
+  assert((meta->size_ & MM_USED) != 0);
+  assert(blk_size(blk) >= bytes);
 #endif
-  meta->pred_ = meta->succ_ = 0;
+  size_t remain = blk_size(blk) - bytes;
   if (remain < free_meta_sz() + MINVOL) {
-    // too small, don't mind. have to allocate all of them to the request.
     return;
   }
-  // else, split the node and reuse the rest.
-
-  // set the size of meta; mark as used.
-  meta->size_ = aligned + used_meta_sz();
-  meta->size_ |= 0x1;
-  // rest of the block(free)
-  void *rest = node + (aligned + used_meta_sz());
-  struct free_meta *rest_meta = static_cast(rest, struct free_meta *);
-  rest_meta->size_ = remain;
-  rest_meta->last_ = static_cast(node, size_t);
-  rest_meta->pred_ = rest_meta->succ_ = 0;
-  if (node == end_blk) {
-    // end_blk should change.
-    end_blk = rest;
-#ifdef DEBUG
-    assert(end_blk + rest_meta->size_ == mem_heap_hi() + 1);
-#endif
-  } else {
-    // should set the pointer of the third node!
-    third->last_ = static_cast(rest, size_t);
+  MM_STAT(split_, 1);
+  meta->size_ = bytes | (meta->size_ & MM_TAGS);
+  // make the rest a used block of its own, then free it as usual(free_blk
+  // takes care of coalescing it with the right neighbor).
+  void *rest = blk + bytes;
+  static_cast(rest, size_t *)[0] = remain | MM_USED | MM_PREV_USED;
+  if (blk == mm_arena->end_blk_) {
+    mm_arena->end_blk_ = rest;
   }
-  // add_free_blk will handle its predecessor and successor.
-  add_free_blk(rest);
-
-  // now you can give node + used_meta_sz() to user, good luck!
+  free_blk(rest);
 }
 
 void add_free_blk(void *blk) {
-  // won't change the end_blk pointer.
+  // won't change the end_blk_ pointer.
   struct free_meta *meta = static_cast(blk, struct free_meta *);
 #ifdef DEBUG
   assert(blk != NULL);
-  assert((meta->size_ & 0x7) == 0);
+  assert((meta->size_ & MM_USED) == 0);
   // meta's size is larger than the block?? Impossible!
-  assert(meta->size_ >= free_meta_sz());
+  assert(blk_size(blk) >= free_meta_sz());
 #endif
-  meta->pred_ = 0;
-  if (meta->size_ - free_meta_sz() < 32U) {
-    // add to small list
-    meta->succ_ = static_cast(mm_small, size_t);
-    struct free_meta *m = static_cast(mm_small, struct free_meta *);
-    if (m != NULL) {
-      m->pred_ = static_cast(blk, size_t);
-    }
-    mm_small = blk;
+  if (blk_size(blk) >= MM_TREE_MIN) {
+    tree_insert(blk);
+    return;
+  }
+  size_t idx = size_class(blk_size(blk));
+  void **head = &mm_arena->bins_[idx];
+  if (*head == MMEOL) {
+    set_bin(idx);
+  }
+#if MM_FIT == MM_FIT_ADDRESS
+  // insert after the last block below blk.
+  void *pred = MMEOL;
+  void *succ = *head;
+  while (succ != MMEOL && succ < blk) {
+    pred = succ;
+    succ = blk_at(static_cast(succ, struct free_meta *)->succ_);
+  }
+  meta->pred_ = blk_off(pred);
+  meta->succ_ = blk_off(succ);
+  if (succ != MMEOL) {
+    static_cast(succ, struct free_meta *)->pred_ = blk_off(blk);
+  }
+  if (pred != MMEOL) {
+    static_cast(pred, struct free_meta *)->succ_ = blk_off(blk);
   } else {
-    if (meta->size_ - free_meta_sz() < 1024U) {
-      meta->succ_ = static_cast(mm_middle, size_t);
-      struct free_meta *m = static_cast(mm_middle, struct free_meta *);
-      if (m != NULL) {
-        m->pred_ = static_cast(blk, size_t);
-      }
-      mm_middle = blk;
-    } else {
-      meta->succ_ = static_cast(mm_large, size_t);
-      struct free_meta *m = static_cast(mm_large, struct free_meta *);
-      if (m != NULL) {
-        m->pred_ = static_cast(blk, size_t);
-      }
-      mm_large = blk;
-    }
+    *head = blk;
+  }
+#else
+  meta->pred_ = 0;
+  meta->succ_ = blk_off(*head);
+  struct free_meta *m = static_cast(*head, struct free_meta *);
+  if (m != NULL) {
+    m->pred_ = blk_off(blk);
+  }
+  *head = blk;
+#endif
+}
+
+#ifdef MM_THREADS
+/**
+ * @brief record that the bytes bytes from start belong to chunk.
+ */
+static void map_chunk(void *chunk, void *start, size_t bytes) {
+  // a granule that starts before start is mapped already.
+  size_t first = static_cast(start - mm_base + MM_GRANULE - 1, size_t) >>
+                 MM_GRANULE_SHIFT;
+  size_t last = static_cast(start + bytes - 1 - mm_base, size_t) >>
+                MM_GRANULE_SHIFT;
+  for (size_t i = first; i <= last; ++i) {
+    mm_chunk_map[i] = chunk - mm_base;
   }
 }
+#endif
 
 int grow_heap(size_t bytes) {
   if (bytes == 0) {
@@ -523,98 +3203,383 @@ int grow_heap(size_t bytes) {
   // test bytes is aligned.
   assert((bytes & 0x7) == 0);
 #endif
+  void *end_blk = mm_arena->end_blk_;
+  if (end_blk != MMEOL && (static_cast(end_blk, size_t *)[0] & MM_USED) == 0 &&
+      blk_size(end_blk) >= bytes) {
+    // the search for a free block may have passed it over.
+    return 0;
+  }
+#ifdef MM_THREADS
+  pthread_mutex_lock(&mm_chunk_lock);
+  if (mm_arena->top_ != NULL &&
+      mm_arena->top_ + ALIGNMENT == mem_heap_hi() + 1) {
+    // the newest chunk is still on top of the memlib heap; grow it in place.
+    void *end = mm_arena->end_blk_;
+    int end_free = (static_cast(end, size_t *)[0] & MM_USED) == 0;
+    size_t more = end_free ? bytes - blk_size(end) : bytes;
+    void *chunk = mm_base + mm_chunk_map[static_cast(end - mm_base, size_t) >>
+                                         MM_GRANULE_SHIFT];
+    void *zero = mem_zero_lo();
+    void *fresh = mem_sbrk(more);
+    if (fresh == (void *)-1) {
+      pthread_mutex_unlock(&mm_chunk_lock);
+      return -1;
+    }
+    pthread_mutex_unlock(&mm_chunk_lock);
+    static_cast(chunk, struct chunk_meta *)->size_ += more;
+    map_chunk(chunk, mm_arena->top_ + ALIGNMENT, more);
+    int keep_zero = end_free && zero <= fresh &&
+                    mm_arena->zero_ <= mm_arena->top_ - ALIGNMENT;
+    if (end_free) {
+      remove_free_blk(end);
+      static_cast(end, size_t *)[0] =
+          bytes | (static_cast(end, size_t *)[0] & MM_TAGS);
+    } else {
+      // the old epilogue becomes the header of the new block.
+      end = mm_arena->top_;
+      static_cast(end, size_t *)[0] = bytes | MM_PREV_USED;
+      mm_arena->end_blk_ = end;
+    }
+    if (keep_zero) {
+      // the old footer and epilogue are all that stand between the zero
+      // bytes of end_blk_ and the fresh ones.
+      static_cast(fresh, size_t *)[-2] = 0;
+      static_cast(fresh, size_t *)[-1] = 0;
+    } else {
+      set_zero(zero > fresh ? zero : fresh);
+    }
+    set_footer(end);
+    mm_arena->top_ += more;
+    static_cast(mm_arena->top_, size_t *)[0] = MM_USED;
+    add_free_blk(end);
+    return 0;
+  }
+
+  // take a new chunk, starting at the next granule.
+  size_t size = (bytes + sizeof(struct chunk_meta) + ALIGNMENT + MM_GRANULE -
+                 1) & ~static_cast(MM_GRANULE - 1, size_t);
+  size_t pad = -static_cast(mem_heap_hi() + 1 - mm_base, size_t) &
+               (MM_GRANULE - 1);
+  void *zero = mem_zero_lo();
+  void *chunk = mem_sbrk(pad + size);
+  pthread_mutex_unlock(&mm_chunk_lock);
+  if (chunk == (void *)-1) {
+    return -1;
+  }
+  chunk += pad;
+  struct chunk_meta *cmeta = static_cast(chunk, struct chunk_meta *);
+  cmeta->size_ = size;
+  cmeta->arena_ = mm_arena;
+  map_chunk(chunk, chunk, size);
+
+  if (mm_arena->end_blk_ != NULL) {
+    // close the old chunk: its epilogue must know about its last block.
+    static_cast(mm_arena->top_, size_t *)[0] =
+        MM_USED |
+        (static_cast(mm_arena->end_blk_, size_t *)[0] & MM_USED ? MM_PREV_USED
+                                                                 : 0);
+  }
+  void *new_blk = chunk + sizeof(struct chunk_meta);
+  static_cast(new_blk, size_t *)[0] =
+      (size - sizeof(struct chunk_meta) - ALIGNMENT) | MM_PREV_USED;
+  set_footer(new_blk);
+  mm_arena->end_blk_ = new_blk;
+  mm_arena->top_ = chunk + size - ALIGNMENT;
+  static_cast(mm_arena->top_, size_t *)[0] = MM_USED;
+  add_free_blk(new_blk);
+  set_zero(zero);
+#else
   void *new_blk = NULL;
-  struct free_meta *end_meta = static_cast(end_blk, struct free_meta *);
-  if ((end_meta->size_ & 0x7) == 0) {
+  struct free_meta *end_meta =
+      static_cast(mm_arena->end_blk_, struct free_meta *);
+  if ((end_meta->size_ & MM_USED) == 0) {
 #ifdef DEBUG
     // the stupid programmer may have assumed that space's not enough.
-    assert(bytes >= end_meta->size_);
+    assert(bytes >= blk_size(mm_arena->end_blk_));
 #endif
     // this is a free block! Have to merge the two blocks
-    new_blk = mem_sbrk(bytes - end_meta->size_);
+    void *zero = mem_zero_lo();
+    new_blk = mem_sbrk(bytes - blk_size(mm_arena->end_blk_));
     if (new_blk == (void *)-1) {
       return -1;
     }
 #ifdef DEBUG
-    // this should be true, cause end_blk is the last block.
-    assert(end_blk + end_meta->size_ == new_blk);
+    // this should be true, cause end_blk_ is the last block.
+    assert(mm_arena->end_blk_ + blk_size(mm_arena->end_blk_) == new_blk);
 #endif
-    end_meta->size_ = bytes;
+    if (zero <= new_blk && mm_arena->zero_ <= new_blk - ALIGNMENT) {
+      // the old footer is all that stands between the zero bytes of
+      // end_blk_ and the fresh ones.
+      static_cast(new_blk, size_t *)[-1] = 0;
+    } else {
+      set_zero(zero > new_blk ? zero : new_blk);
+    }
+    // its class changes with its size.
+    remove_free_blk(mm_arena->end_blk_);
+    end_meta->size_ = bytes | (end_meta->size_ & MM_TAGS);
+    set_footer(mm_arena->end_blk_);
+    add_free_blk(mm_arena->end_blk_);
   } else {
     // should allocate bytes.
+    void *zero = mem_zero_lo();
     new_blk = mem_sbrk(bytes);
     if (new_blk == (void *)-1) {
       return -1;
     }
 #ifdef DEBUG
-    // this should be true, cause end_blk is the last block.
-    assert(end_blk + (end_meta->size_ & (~0x7)) == new_blk);
+    // this should be true, cause end_blk_ is the last block.
+    assert(mm_arena->end_blk_ + blk_size(mm_arena->end_blk_) == new_blk);
 #endif
     // this is a used block:)
     struct free_meta *meta = static_cast(new_blk, struct free_meta *);
-    meta->size_ = bytes;
-    meta->pred_ = meta->succ_ = 0;
-    meta->last_ = static_cast(end_blk, size_t);
-    end_blk = new_blk;
+    meta->size_ = bytes | MM_PREV_USED;
+    set_footer(new_blk);
+    mm_arena->end_blk_ = new_blk;
+    add_free_blk(new_blk);
+    set_zero(zero);
+  }
+#endif
+
+  return 0;
+}
+
+/**
+ * @brief top-down splay of the tree rooted at root around key (size, blk).
+ * @return the new root, which is the node of that key if it is in the
+ * tree, and otherwise its predecessor or successor in the tree.
+ */
+static void *splay(void *root, size_t size, void *blk) {
+  if (root == MMEOL) {
+    return MMEOL;
+  }
+  // left and right trees are assembled under header.
+  struct tree_meta header;
+  header.left_ = header.right_ = 0;
+  struct tree_meta *l = &header, *r = &header;
+  void *t = root;
+  struct tree_meta *tm = static_cast(t, struct tree_meta *);
+
+  for (;;) {
+    int cmp = key_cmp(size, blk, t);
+    if (cmp < 0) {
+      void *y = blk_at(tm->left_);
+      if (y == MMEOL) {
+        break;
+      }
+      struct tree_meta *ym = static_cast(y, struct tree_meta *);
+      if (key_cmp(size, blk, y) < 0) {
+        // rotate right
+        tm->left_ = ym->right_;
+        ym->right_ = blk_off(t);
+        t = y;
+        tm = ym;
+        if (tm->left_ == 0) {
+          break;
+        }
+      }
+      // link right
+      r->left_ = blk_off(t);
+      r = tm;
+      t = blk_at(tm->left_);
+      tm = static_cast(t, struct tree_meta *);
+    } else if (cmp > 0) {
+      void *y = blk_at(tm->right_);
+      if (y == MMEOL) {
+        break;
+      }
+      struct tree_meta *ym = static_cast(y, struct tree_meta *);
+      if (key_cmp(size, blk, y) > 0) {
+        // rotate left
+        tm->right_ = ym->left_;
+        ym->left_ = blk_off(t);
+        t = y;
+        tm = ym;
+        if (tm->right_ == 0) {
+          break;
+        }
+      }
+      // link left
+      l->right_ = blk_off(t);
+      l = tm;
+      t = blk_at(tm->right_);
+      tm = static_cast(t, struct tree_meta *);
+    } else {
+      break;
+    }
+  }
+
+  // assemble
+  l->right_ = tm->left_;
+  r->left_ = tm->right_;
+  tm->left_ = header.right_;
+  tm->right_ = header.left_;
+  return t;
+}
+
+void *tree_fit(size_t size) {
+  // the smallest key not less than (size, 0)
+  mm_arena->tree_ = splay(mm_arena->tree_, size, MMEOL);
+  if (mm_arena->tree_ == MMEOL) {
+    return MMEOL;
+  }
+  if (blk_size(mm_arena->tree_) >= size) {
+    return mm_arena->tree_;
+  }
+  // root is the predecessor, so the answer is leftmost in its right subtree.
+  struct tree_meta *meta = static_cast(mm_arena->tree_, struct tree_meta *);
+  void *it = blk_at(meta->right_);
+  if (it == MMEOL) {
+    return MMEOL;
+  }
+  meta = static_cast(it, struct tree_meta *);
+  while (meta->left_ != 0) {
+    it = blk_at(meta->left_);
+    meta = static_cast(it, struct tree_meta *);
+  }
+  return it;
+}
+
+void tree_insert(void *blk) {
+  struct tree_meta *meta = static_cast(blk, struct tree_meta *);
+  meta->epoch_ = mm_arena->epoch_;
+  if (mm_arena->tree_ == MMEOL) {
+    meta->left_ = meta->right_ = 0;
+    mm_arena->tree_ = blk;
+    return;
   }
+  void *t = splay(mm_arena->tree_, blk_size(blk), blk);
+  struct tree_meta *tm = static_cast(t, struct tree_meta *);
+#ifdef DEBUG
+  assert(t != blk);
+#endif
+  if (key_cmp(blk_size(blk), blk, t) < 0) {
+    meta->left_ = tm->left_;
+    meta->right_ = blk_off(t);
+    tm->left_ = 0;
+  } else {
+    meta->right_ = tm->right_;
+    meta->left_ = blk_off(t);
+    tm->right_ = 0;
+  }
+  mm_arena->tree_ = blk;
+}
+
+void tree_remove(void *blk) {
+  struct tree_meta *meta = static_cast(blk, struct tree_meta *);
+  void *t = splay(mm_arena->tree_, blk_size(blk), blk);
+#ifdef DEBUG
+  // blk must be in the tree.
+  assert(t == blk);
+#endif
+  if (meta->left_ == 0) {
+    mm_arena->tree_ = blk_at(meta->right_);
+  } else {
+    // every key on the left is smaller, so the maximum is splayed to root.
+    t = splay(blk_at(meta->left_), blk_size(blk), blk);
+    static_cast(t, struct tree_meta *)->right_ = meta->right_;
+    mm_arena->tree_ = t;
+  }
+  meta->left_ = meta->right_ = 0;
+}
 
+/**
+ * @brief check the boundary tags of a free block.
+ * @return non zero if the footer or the right neighbor disagrees.
+ */
+int check_free_blk(void *blk) {
+  size_t size = blk_size(blk);
+  if (static_cast(blk + size - sizeof(size_t), size_t *)[0] != size) {
+    fprintf(stderr, "Free block %p has a wrong footer\n", blk);
+    return -1;
+  }
+  if ((static_cast(blk, size_t *)[0] & MM_PREV_USED) == 0) {
+    fprintf(stderr, "Free block %p has a free left neighbor\n", blk);
+    return -1;
+  }
+  void *next = get_next(blk);
+  if (next != MMEOL && (static_cast(next, size_t *)[0] &
+                        (MM_USED | MM_PREV_USED)) != MM_USED) {
+    fprintf(stderr, "Free block %p has a bad right neighbor\n", blk);
+    return -1;
+  }
   return 0;
 }
 
 /**
- * @param min_sz minimal size of block in the free list
- * @param max_sz maximal size of block in the free list
+ * @param idx size class of the free list
  * @return non zero if the free list is inconsistent
  */
-int check_free_lst(void *head, const char *lst_name, size_t min_sz,
-                   size_t max_sz) {
-  min_sz += free_meta_sz();
-  max_sz += free_meta_sz();
+int check_free_lst(size_t idx) {
+  void *head = mm_arena->bins_[idx];
+  int marked = (mm_arena->sl_map_[idx >> MM_CLASS_SHIFT] >>
+                (idx & ((1 << MM_CLASS_SHIFT) - 1))) &
+               1;
+  if (marked != (head != NULL)) {
+    fprintf(stderr, "bins_[%zu] disagrees with the bitmap\n", idx);
+    return -1;
+  }
+  if (((mm_arena->fl_map_ >> (idx >> MM_CLASS_SHIFT)) & 1) !=
+      (mm_arena->sl_map_[idx >> MM_CLASS_SHIFT] != 0)) {
+    fprintf(stderr, "fl_map_ disagrees with sl_map_[%zu]\n",
+            idx >> MM_CLASS_SHIFT);
+    return -1;
+  }
   if (head == NULL) {
     return 0;
   }
   void *it1 = head;
   struct free_meta *m1 = static_cast(it1, struct free_meta *);
   if (m1->pred_ != 0) {
-    fprintf(stderr, "In %s: first node's predecessor is not null\n", lst_name);
+    fprintf(stderr, "In bins_[%zu]: first node's predecessor is not null\n",
+            idx);
+    return -1;
+  }
+  if ((m1->size_ & MM_USED) != 0) {
+    fprintf(stderr, "In bins_[%zu]: first node's not free\n", idx);
     return -1;
   }
-  if ((m1->size_ & 0x7) != 0) {
-    fprintf(stderr, "In %s: first node's not free\n", lst_name);
+  if (size_class(blk_size(it1)) != idx) {
+    fprintf(stderr, "In bins_[%zu], got a block that has size %zu.\n", idx,
+            blk_size(it1));
     return -1;
   }
-  if (m1->size_ >= max_sz || m1->size_ < min_sz) {
-    fprintf(
-        stderr,
-        "In %s, got a block that has size %ul, expected in range (%ul, %ul).\n",
-        lst_name, m1->size_, min_sz, max_sz);
+  if (check_free_blk(it1) != 0) {
     return -1;
   }
-  void *it2 = static_cast(m1->succ_, void *);
+  void *it2 = blk_at(m1->succ_);
   struct free_meta *m2 = static_cast(it2, struct free_meta *);
 
   while (it2 != NULL) {
     // check prev, succ link.
-    if ((m2->size_ & 0x7) != 0) {
-      fprintf(stderr, "In %s, have non-free block\n", lst_name);
+    if ((m2->size_ & MM_USED) != 0) {
+      fprintf(stderr, "In bins_[%zu], have non-free block\n", idx);
+      return -1;
+    }
+
+    if (size_class(blk_size(it2)) != idx) {
+      fprintf(stderr, "In bins_[%zu], got a block that has size %zu.\n",
+              idx, blk_size(it2));
       return -1;
     }
 
-    if (m2->size_ >= max_sz || m2->size_ < min_sz) {
-      fprintf(stderr,
-              "In %s, got a block that has size %ul, expected in range (%ul, "
-              "%ul).\n",
-              lst_name, m2->size_, min_sz, max_sz);
+    if (m2->pred_ != blk_off(it1)) {
+      fprintf(stderr, "In bins_[%zu], predecessor is errorneous\n", idx);
       return -1;
     }
+#if MM_FIT == MM_FIT_ADDRESS
+    if (it2 < it1) {
+      fprintf(stderr, "In bins_[%zu], blocks are out of address order\n",
+              idx);
+      return -1;
+    }
+#endif
 
-    if (m2->pred_ != static_cast(it1, size_t)) {
-      fprintf(stderr, "In %s, predecessor is errorneous\n", lst_name);
+    if (check_free_blk(it2) != 0) {
       return -1;
     }
 
     it1 = it2;
-    it2 = static_cast(m2->succ_, void *);
+    it2 = blk_at(m2->succ_);
     m1 = static_cast(it1, struct free_meta *);
     m2 = static_cast(it2, struct free_meta *);
   }
@@ -622,32 +3587,252 @@ int check_free_lst(void *head, const char *lst_name, size_t min_sz,
   return 0;
 }
 
+/**
+ * @brief check the subtree rooted at node, whose keys must lie strictly
+ * between (lo_sz, lo_blk) and (hi_sz, hi_blk).
+ * @return number of nodes in the subtree, negative if it is inconsistent.
+ */
+int check_tree(void *node, size_t lo_sz, void *lo_blk, size_t hi_sz,
+               void *hi_blk) {
+  if (node == MMEOL) {
+    return 0;
+  }
+  struct tree_meta *meta = static_cast(node, struct tree_meta *);
+  if ((meta->size_ & MM_USED) != 0) {
+    fprintf(stderr, "In tree_, have non-free block\n");
+    return -1;
+  }
+  if (blk_size(node) < MM_TREE_MIN) {
+    fprintf(stderr, "In tree_, got a block that has size %zu.\n",
+            blk_size(node));
+    return -1;
+  }
+  if (key_cmp(lo_sz, lo_blk, node) >= 0 || key_cmp(hi_sz, hi_blk, node) <= 0) {
+    fprintf(stderr, "In tree_, block %p is out of order\n", node);
+    return -1;
+  }
+  if (check_free_blk(node) != 0) {
+    return -1;
+  }
+  int left = check_tree(blk_at(meta->left_), lo_sz, lo_blk, blk_size(node),
+                        node);
+  int right = check_tree(blk_at(meta->right_), blk_size(node), node, hi_sz,
+                         hi_blk);
+  if (left < 0 || right < 0) {
+    return -1;
+  }
+  return left + right + 1;
+}
+
+/**
+ * @brief walk the blocks in [blk, top) in address order, and count the free
+ * ones into nfree.
+ * @return the last block, or MMEOL if a block disagrees with its left
+ * neighbor, two free blocks are adjacent, or the walk overshoots top.
+ */
+static void *check_run(void *blk, void *top, size_t *nfree) {
+  void *last = MMEOL;
+  size_t prev_used = MM_PREV_USED;
+  while (blk < top) {
+    size_t word = static_cast(blk, size_t *)[0];
+    size_t size = blk_size(blk);
+    if (size < free_meta_sz() || blk + size > top) {
+      fprintf(stderr, "Block %p has size %zu\n", blk, size);
+      return MMEOL;
+    }
+    if ((word & MM_PREV_USED) != prev_used) {
+      fprintf(stderr, "Block %p disagrees with its left neighbor\n", blk);
+      return MMEOL;
+    }
+    if ((word & MM_USED) == 0) {
+      if (prev_used == 0) {
+        fprintf(stderr, "Free block %p is not coalesced\n", blk);
+        return MMEOL;
+      }
+      if (static_cast(blk + size, size_t *)[-1] != size) {
+        fprintf(stderr, "Free block %p has a wrong footer\n", blk);
+        return MMEOL;
+      }
+      ++*nfree;
+    }
+    prev_used = (word & MM_USED) != 0 ? MM_PREV_USED : 0;
+    last = blk;
+    blk += size;
+  }
+  return last;
+}
+
+/**
+ * @brief walk the blocks of the heap(with MM_THREADS, of every chunk of the
+ * arena) in address order.
+ * @param ntree number of blocks in tree_
+ * @return non zero if a block disagrees with its left neighbor, two free
+ * blocks are adjacent, the walk does not end with end_blk_, or the free
+ * lists hold other blocks than those found.
+ */
+int check_blocks(size_t ntree) {
+  size_t nfree = 0;
+#ifdef MM_THREADS
+  // chunks of the arena can't change under us, but the heap may grow.
+  // a trimmed heap may end inside a granule, whose chunk counts too.
+  pthread_mutex_lock(&mm_chunk_lock);
+  size_t ngranule = static_cast(mem_heap_hi() + MM_GRANULE - mm_base,
+                                size_t) >> MM_GRANULE_SHIFT;
+  pthread_mutex_unlock(&mm_chunk_lock);
+  for (size_t i = 0; i < ngranule; ++i) {
+    // a chunk is found at the first granule it maps.
+    void *chunk = mm_base + mm_chunk_map[i];
+    if (chunk != mm_base + (i << MM_GRANULE_SHIFT) ||
+        static_cast(chunk, struct chunk_meta *)->arena_ != mm_arena) {
+      continue;
+    }
+    void *top =
+        chunk + static_cast(chunk, struct chunk_meta *)->size_ - ALIGNMENT;
+    void *last = check_run(chunk + sizeof(struct chunk_meta), top, &nfree);
+    if (last == MMEOL) {
+      return -1;
+    }
+    if (top == mm_arena->top_) {
+      if (last != mm_arena->end_blk_) {
+        fprintf(stderr, "The walk ends at %p, not at end_blk_\n", last);
+        return -1;
+      }
+    } else if (((static_cast(top, size_t *)[0] & MM_PREV_USED) != 0) !=
+               ((static_cast(last, size_t *)[0] & MM_USED) != 0)) {
+      fprintf(stderr, "The epilogue at %p disagrees with %p\n", top, last);
+      return -1;
+    }
+  }
+#else
+  // skip the prologue.
+  void *last = check_run(mm_base + ALIGNMENT, heap_top(), &nfree);
+  if (last == MMEOL) {
+    return -1;
+  }
+  if (last != mm_arena->end_blk_) {
+    fprintf(stderr, "The walk ends at %p, not at end_blk_\n", last);
+    return -1;
+  }
+#endif
+
+  // fast bins, thread caches and remote stacks hold used blocks only.
+  size_t nlisted = ntree;
+  for (size_t idx = 0; idx < MM_NUM_CLASSES; ++idx) {
+    for (void *it = mm_arena->bins_[idx]; it != MMEOL;
+         it = blk_at(static_cast(it, struct free_meta *)->succ_)) {
+      ++nlisted;
+    }
+  }
+  if (nfree != nlisted) {
+    fprintf(stderr, "Found %zu free blocks, but %zu are listed\n", nfree,
+            nlisted);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @param cls slab class of the list
+ * @return non zero if the slab list is inconsistent
+ */
+int check_slab_lst(size_t cls) {
+  unsigned int pred = 0;
+  for (void *it = mm_arena->slabs_[cls]; it != MMEOL;) {
+    struct slab_meta *meta = static_cast(it, struct slab_meta *);
+    if (!is_slab(it) || slab_of(it) != it) {
+      fprintf(stderr, "In slabs_[%zu], %p is not a slab\n", cls, it);
+      return -1;
+    }
+    if (meta->slot_ != (cls + 1) * ALIGNMENT) {
+      fprintf(stderr, "In slabs_[%zu], got a slab of %u bytes slots\n", cls,
+              meta->slot_);
+      return -1;
+    }
+    if (meta->pred_ != pred) {
+      fprintf(stderr, "In slabs_[%zu], predecessor is errorneous\n", cls);
+      return -1;
+    }
+    size_t nfree = 0;
+    for (size_t w = 0; w * 32 < meta->nslot_; ++w) {
+      nfree += __builtin_popcount(meta->map_[w]);
+      if (w < meta->hint_ && meta->map_[w] != 0) {
+        fprintf(stderr, "In slabs_[%zu], hint is errorneous\n", cls);
+        return -1;
+      }
+    }
+    if (meta->used_ >= meta->nslot_ || nfree + meta->used_ != meta->nslot_) {
+      fprintf(stderr, "In slabs_[%zu], slab %p miscounts free slots\n", cls,
+              it);
+      return -1;
+    }
+    pred = blk_off(it);
+    it = blk_at(meta->succ_);
+  }
+  return 0;
+}
+
 int mm_check() {
   int res;
 
-  // check rule 0: end_blk is pointing to the end.
-  struct free_meta *end = static_cast(end_blk, struct free_meta *);
-  if (end_blk == NULL) {
-    fprintf(stderr, "end_blk is null?? Impossible!\n");
+  // check rule 0: end_blk_ is pointing to the end.
+#ifdef MM_THREADS
+  if (mm_arena->end_blk_ == NULL && mm_arena->top_ == NULL) {
+    // the arena has no chunk yet.
+    return 0;
+  }
+#endif
+  if (mm_arena->end_blk_ == NULL) {
+    fprintf(stderr, "end_blk_ is null?? Impossible!\n");
     goto bad;
   }
-  if (end_blk + (end->size_ & (~0x7)) != mem_heap_hi() + 1) {
-    fprintf(stderr, "end_blk is pointing to erroroues block\n");
+  if (mm_arena->end_blk_ + blk_size(mm_arena->end_blk_) != heap_top()) {
+    fprintf(stderr, "end_blk_ is pointing to erroroues block\n");
     goto bad;
   }
 
-  // check rule 1: the free list is consistent
-  res = check_free_lst(mm_small, "mm_small", 0, 32U);
-  if (res != 0) {
+  // check rule 1, 3: the free lists are consistent
+  for (size_t idx = 0; idx < MM_NUM_CLASSES; ++idx) {
+    res = check_free_lst(idx);
+    if (res != 0) {
+      goto bad;
+    }
+  }
+
+  // check rule 2, 3: the tree is consistent
+  res = check_tree(mm_arena->tree_, 0, MMEOL, static_cast(-1, size_t), MMEOL);
+  if (res < 0) {
     goto bad;
   }
-  res = check_free_lst(mm_middle, "mm_middle", 32U, 1024U);
+
+  // check rule 6: every block agrees with its neighbors
+  res = check_blocks(res);
   if (res != 0) {
     goto bad;
   }
-  res = check_free_lst(mm_large, "mm_large", 1024U,
-                       static_cast(-1, size_t) - free_meta_sz());
-  if (res != 0) {
+
+  // check rule 4: the slab lists are consistent
+  for (size_t cls = 0; cls < MM_SLAB_CLASSES; ++cls) {
+    res = check_slab_lst(cls);
+    if (res != 0) {
+      goto bad;
+    }
+  }
+
+  // check rule 5: the fast bins are consistent
+  size_t fast_bytes = 0;
+  for (size_t i = 0; i < MM_FAST_BINS; ++i) {
+    for (void *it = mm_arena->fast_[i]; it != MMEOL;
+         it = blk_at(static_cast(it, struct fast_meta *)->succ_)) {
+      if ((static_cast(it, size_t *)[0] & MM_USED) == 0 ||
+          blk_size(it) != i * ALIGNMENT) {
+        fprintf(stderr, "In fast_[%zu], got a free or misplaced block\n", i);
+        goto bad;
+      }
+      fast_bytes += blk_size(it);
+    }
+  }
+  if (fast_bytes != mm_arena->fast_bytes_) {
+    fprintf(stderr, "fast_bytes_ is errorneous\n");
     goto bad;
   }
 
@@ -656,33 +3841,43 @@ bad:
   return -1;
 }
 
-// again, won't affect end_blk! Don't worry~
+// again, won't affect end_blk_! Don't worry~
 void remove_free_blk(void *blk) {
   struct free_meta *meta = static_cast(blk, struct free_meta *);
 #ifdef DEBUG
   // is the node null?
   assert(blk != MMEOL);
   // is the node free?
-  assert((meta->size_ & 0x7) == 0);
+  assert((meta->size_ & MM_USED) == 0);
 #endif
-  struct free_meta *pred_meta = static_cast(meta->pred_, struct free_meta *);
-  struct free_meta *succ_meta = static_cast(meta->succ_, struct free_meta *);
+  if (blk_size(blk) >= MM_TREE_MIN) {
+    tree_remove(blk);
+    return;
+  }
+  struct free_meta *pred_meta = blk_at(meta->pred_);
+  struct free_meta *succ_meta = blk_at(meta->succ_);
   if (pred_meta != NULL) {
-    pred_meta->succ_ = static_cast(succ_meta, size_t);
+    pred_meta->succ_ = meta->succ_;
   }
   if (succ_meta != NULL) {
-    succ_meta->pred_ = static_cast(pred_meta, size_t);
-  }
-
-  // what is blk is one of the mm_small, mm_middle, mm_large?
-  if (blk == mm_small) {
-    mm_small = static_cast(succ_meta, void *);
+    succ_meta->pred_ = meta->pred_;
   }
-  if (blk == mm_middle) {
-    mm_middle = static_cast(succ_meta, void *);
+  size_t idx = size_class(blk_size(blk));
+#if MM_FIT == MM_FIT_NEXT
+  if (mm_arena->rover_[idx] == blk) {
+    mm_arena->rover_[idx] = static_cast(succ_meta, void *);
   }
-  if (blk == mm_large) {
-    mm_large = static_cast(succ_meta, void *);
+#endif
+
+  // no predecessor: blk is the head of the list of its class.
+  if (pred_meta == NULL) {
+#ifdef DEBUG
+    assert(mm_arena->bins_[idx] == blk);
+#endif
+    mm_arena->bins_[idx] = static_cast(succ_meta, void *);
+    if (succ_meta == NULL) {
+      clear_bin(idx);
+    }
   }
 
   // remove the tag associated with meta.
@@ -691,28 +3886,25 @@ void remove_free_blk(void *blk) {
 
 void merge_blk(void *left, void *right) {
   struct free_meta *left_mt = static_cast(left, struct free_meta *);
-  struct free_meta *right_mt = static_cast(right, struct free_meta *);
 #ifdef DEBUG
+  struct free_meta *right_mt = static_cast(right, struct free_meta *);
   // is left and right not null?
   assert(left != NULL && right != NULL);
   // is left and right free?
-  assert((left_mt->size_ & 0x7) == 0);
-  assert((right_mt->size_ & 0x7) == 0);
+  assert((left_mt->size_ & MM_USED) == 0);
+  assert((right_mt->size_ & MM_USED) == 0);
   // is left adjacent to right?
-  assert(right_mt->last_ == static_cast(left, size_t));
-  assert(left + left_mt->size_ == right);
-#endif
-  assert(left != end_blk);
-  struct free_meta *third_mt =
-      static_cast(right + right_mt->size_, struct free_meta *);
-  if (right != end_blk) {
-    // must change the last of third.
-    third_mt->last_ = static_cast(left, size_t);
-  } else {
-    // set end_blk to be left.
-    end_blk = left;
+  assert((right_mt->size_ & MM_PREV_USED) == 0);
+  assert(left + blk_size(left) == right);
+#endif
+  assert(left != mm_arena->end_blk_);
+  if (right == mm_arena->end_blk_) {
+    // set end_blk_ to be left.
+    mm_arena->end_blk_ = left;
   }
-  left_mt->size_ += right_mt->size_;
+  MM_STAT(coalesce_, 1);
+  left_mt->size_ += blk_size(right);
+  set_footer(left);
 }
 
 /**
@@ -4,6 +4,31 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_calloc(size_t n, size_t size);
+extern int mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+#ifdef MM_STATS
+extern void mm_stats(void);
+#endif
+#ifdef MM_PROFILE
+extern int mm_dump_heap(int fd);
+#endif
+extern void *mm_memalign(size_t align, size_t size);
+extern void *mm_aligned_alloc(size_t align, size_t size);
+
+/* regions: bump allocation, everything freed at once */
+struct mm_region;
+extern struct mm_region *mm_region_create(size_t chunk);
+extern void *mm_region_alloc(struct mm_region *region, size_t size);
+extern void mm_region_reset(struct mm_region *region);
+extern void mm_region_destroy(struct mm_region *region);
+
+/* pools: objects of a single size */
+struct mm_pool;
+extern struct mm_pool *mm_pool_create(size_t obj_size, size_t align);
+extern void *mm_pool_get(struct mm_pool *pool);
+extern void mm_pool_put(struct mm_pool *pool, void *obj);
+extern void mm_pool_destroy(struct mm_pool *pool);
 
 
 /* 
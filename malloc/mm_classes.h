@@ -0,0 +1,15 @@
+/*
+ * mm_classes.h - size classes of mm.c, picked by mkclasses from 11
+ * traces. Do not edit, run "make classes" instead.
+ */
+#define MM_SLAB_MAX 24
+#define MM_FAST_MAX 256
+#define MM_CLASS_SHIFT 2
+#define MM_TREE_SHIFT 10
+
+/** smallest block size of each class of bins_ */
+static const unsigned int mm_class_min[] = {
+    0, 8, 16, 24, 32, 40, 48, 56,
+    64, 80, 96, 112, 128, 160, 192, 224,
+    256, 320, 384, 448, 512, 640, 768, 896,
+};